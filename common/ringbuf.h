@@ -0,0 +1,165 @@
+/*
+ * Single-producer/single-consumer ring buffer with 8-bit indices, used
+ * by the uart and usi_uart drivers.
+ *
+ * The producer (eg the rx interrupt) only writes 'tail', the consumer
+ * (eg the main loop) only writes 'head'. Both are single bytes, so they
+ * are read and written atomically and no interrupts need to be disabled.
+ *
+ * The data itself lives in a separate array whose size must be a power
+ * of 2 (2..256); the functions take the index mask (size-1). One field
+ * is always kept free to tell a full from an empty buffer.
+ */
+#ifndef RINGBUF_H
+#define RINGBUF_H
+
+#include <stdint.h>
+#include <string.h>
+
+typedef struct {
+	volatile uint8_t head;	/* next field to read */
+	volatile uint8_t tail;	/* next field to write */
+} ringbuf_t;
+
+/* compile-time check of a buffer size, use at file scope */
+#define RINGBUF_CHECK_SIZE(name, size) \
+	typedef char name##_size_must_be_a_power_of_2_up_to_256[ \
+		((size) >= 2 && (size) <= 256 && ((size) & ((size)-1)) == 0) ? 1 : -1]
+
+/* keep the compiler from moving buffer accesses past index updates */
+#define ringbuf_barrier() __asm__ __volatile__ ("" ::: "memory")
+
+
+static inline void
+ringbuf_init(ringbuf_t *r)
+{
+	r->head = 0;
+	r->tail = 0;
+}
+
+/* number of fields that can be read */
+static inline uint8_t
+ringbuf_used(ringbuf_t *r, uint8_t mask)
+{
+	return (r->tail - r->head) & mask;
+}
+
+/* number of fields that can be written */
+static inline uint8_t
+ringbuf_free(ringbuf_t *r, uint8_t mask)
+{
+	return (r->head - r->tail - 1) & mask;
+}
+
+static inline uint8_t
+ringbuf_empty(ringbuf_t *r)
+{
+	return r->head == r->tail;
+}
+
+/* append c, returns 1 if the buffer is full */
+static inline uint8_t
+ringbuf_put(ringbuf_t *r, uint8_t *buf, uint8_t mask, uint8_t c)
+{
+	uint8_t tail = r->tail;
+	uint8_t next = (tail+1) & mask;
+
+	if (next == r->head)
+		return 1;
+
+	buf[tail] = c;
+	ringbuf_barrier();
+	r->tail = next;
+	return 0;
+}
+
+/* remove the oldest field and store it in c, returns 1 if the buffer is empty */
+static inline uint8_t
+ringbuf_get(ringbuf_t *r, uint8_t *buf, uint8_t mask, uint8_t *c)
+{
+	uint8_t head = r->head;
+
+	if (head == r->tail)
+		return 1;
+
+	*c = buf[head];
+	ringbuf_barrier();
+	r->head = (head+1) & mask;
+	return 0;
+}
+
+/*
+ * Contiguous segment access: peek returns the number of fields that can be
+ * written starting at &buf[r->tail] (read starting at &buf[r->head]) without
+ * wrapping, commit hands 'n' of them over to the other side.
+ */
+static inline uint8_t
+ringbuf_write_peek(ringbuf_t *r, uint8_t mask)
+{
+	uint8_t avail = ringbuf_free(r, mask);
+	uint8_t to_end = mask - r->tail;	/* fields up to the end, minus one */
+
+	return avail <= to_end ? avail : to_end+1;
+}
+
+static inline void
+ringbuf_write_commit(ringbuf_t *r, uint8_t mask, uint8_t n)
+{
+	ringbuf_barrier();
+	r->tail = (r->tail + n) & mask;
+}
+
+static inline uint8_t
+ringbuf_read_peek(ringbuf_t *r, uint8_t mask)
+{
+	uint8_t avail = ringbuf_used(r, mask);
+	uint8_t to_end = mask - r->head;
+
+	return avail <= to_end ? avail : to_end+1;
+}
+
+static inline void
+ringbuf_read_commit(ringbuf_t *r, uint8_t mask, uint8_t n)
+{
+	ringbuf_barrier();
+	r->head = (r->head + n) & mask;
+}
+
+/* copy up to len bytes from src into the buffer, returns the number copied */
+static inline uint8_t
+ringbuf_write(ringbuf_t *r, uint8_t *buf, uint8_t mask,
+		const uint8_t *src, uint8_t len)
+{
+	uint8_t n, count = 0;
+
+	/* at most two segments: up to the end of buf, then from its start */
+	while (count < len && (n = ringbuf_write_peek(r, mask)) != 0) {
+		if (n > len-count)
+			n = len-count;
+		memcpy(&buf[r->tail], src+count, n);
+		ringbuf_write_commit(r, mask, n);
+		count += n;
+	}
+
+	return count;
+}
+
+/* copy up to len bytes from the buffer into dest, returns the number copied */
+static inline uint8_t
+ringbuf_read(ringbuf_t *r, uint8_t *buf, uint8_t mask,
+		uint8_t *dest, uint8_t len)
+{
+	uint8_t n, count = 0;
+
+	while (count < len && (n = ringbuf_read_peek(r, mask)) != 0) {
+		if (n > len-count)
+			n = len-count;
+		memcpy(dest+count, &buf[r->head], n);
+		ringbuf_read_commit(r, mask, n);
+		count += n;
+	}
+
+	return count;
+}
+
+#endif
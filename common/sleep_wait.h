@@ -0,0 +1,41 @@
+/*
+ * Waiting for interrupts in idle sleep mode, used by the blocking
+ * functions of the uart and usi_uart drivers.
+ */
+#ifndef SLEEP_WAIT_H
+#define SLEEP_WAIT_H
+
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+
+/*
+ * Sleep in idle mode as long as 'cond' is true, each interrupt wakes the
+ * cpu to check it again. 'cond' is evaluated with interrupts disabled; the
+ * instruction following sei is always executed before a pending interrupt,
+ * so an interrupt that changes 'cond' right after the check still wakes
+ * us up. The status register is restored afterwards.
+ *
+ * With interrupts disabled on entry (eg in an ATOMIC_BLOCK or an
+ * interrupt routine) nothing could wake us up, 'cond' is polled instead
+ * and interrupts stay disabled.
+ */
+#define SLEEP_WAIT_WHILE(cond) \
+	do { \
+		uint8_t sreg_ = SREG; \
+		if (!(sreg_ & (1<<SREG_I))) { \
+			while (cond) ; \
+			break; \
+		} \
+		set_sleep_mode(SLEEP_MODE_IDLE); \
+		cli(); \
+		while (cond) { \
+			sleep_enable(); \
+			sei(); \
+			sleep_cpu(); \
+			sleep_disable(); \
+			cli(); \
+		} \
+		SREG = sreg_; \
+	} while (0)
+
+#endif
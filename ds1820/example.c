@@ -1,4 +1,3 @@
-#include <stdlib.h>
 #include <avr/io.h>
 #include <avr/interrupt.h>
 #include <util/delay.h>
@@ -14,15 +13,13 @@ int main()
 {
 	ds1820_t sensors[MAX_SENSORS];
 	int8_t ret, count;
-	char text_buf[32];
 
 	uart_init();
 	sei();
 
 	/* search the bus for temperature sensors */
 	count = ds1820_search_bus(sensors, MAX_SENSORS);
-	uart_puts(itoa(count, text_buf, 10));
-	uart_puts(" sensors found\n");
+	uart_printf_P(PSTR("%d sensors found\n"), count);
 
 	while (1) {
 
@@ -32,24 +29,23 @@ int main()
 		/* wait for conversion */
 		_delay_ms(DS1820_CONV_TIME_MAX);
 
-		uart_puts("Readings:\n");
+		uart_puts_PSTR("Readings:\n");
 
 		for (uint8_t i=0; i<count; i++) {
 			/* read sensor's scratchpad */
 			ret = ds1820_read_scratchpad(&sensors[i]);
 			if (ret != 0) {
 				/* crc check failed */
-				uart_puts("crc error\n");
+				uart_puts_PSTR("crc error\n");
 				continue;
 			}
 
-			/* copy sensor's temperature to text_buf */
-			ds1820_get_temperature_as_string(&sensors[i], text_buf);
-			uart_puts(text_buf);
-			uart_puts("\n");
+			/* print sensor's temperature with one decimal */
+			uart_printf_P(PSTR("%.1d\n"),
+					ds1820_get_temperature_deci_degrees(&sensors[i]));
 		}
 
-		uart_puts("\n");
+		uart_puts_PSTR("\n");
 		_delay_ms(2000);
 	}
 }
@@ -0,0 +1,36 @@
+/* sends every received frame back, with the payload reversed */
+
+#include <avr/interrupt.h>
+#include "uart.h"
+#include "frame.h"
+
+#define MAX_PAYLOAD 32
+
+
+int main()
+{
+	uint8_t buf[FRAME_BUFFER_SIZE(MAX_PAYLOAD)], tmp;
+	uint8_t i, ret;
+	frame_decoder_t rx;
+
+	uart_init();
+	sei();
+
+	frame_decoder_init(&rx, buf, sizeof(buf));
+
+	while (1) {
+		ret = frame_receive(&rx, uart_getc);
+
+		if (ret == FRAME_OK) {
+			for (i=0; i<rx.len/2; i++) {
+				tmp = buf[i];
+				buf[i] = buf[rx.len-1-i];
+				buf[rx.len-1-i] = tmp;
+			}
+			frame_send(uart_putc, buf, rx.len);
+		} else if (ret != FRAME_INCOMPLETE) {
+			/* broken frame: answer with an empty one */
+			frame_send(uart_putc, 0, 0);
+		}
+	}
+}
@@ -0,0 +1,134 @@
+#include <util/crc16.h>
+#include "frame.h"
+
+/* longest run of non-zero bytes in one COBS block */
+#define BLOCK_MAX 254
+
+
+/* byte 'i' of the payload followed by the crc */
+static inline uint8_t
+frame_byte(const uint8_t *buf, uint8_t len, uint16_t crc, uint16_t i)
+{
+	if (i < len) return buf[i];
+	if (i == len) return crc >> 8;
+	return crc & 0xFF;
+}
+
+uint8_t
+frame_send(frame_putc_t put, const uint8_t *buf, uint8_t len)
+{
+	uint16_t crc = 0, n, i, j, k;
+	uint8_t err = 0;
+
+	if (len > FRAME_MAX_PAYLOAD) return 1;
+
+	for (i=0; i<len; i++)
+		crc = _crc_xmodem_update(crc, buf[i]);
+
+	n = len + FRAME_CRC_SIZE;
+	i = 0;
+	while (1) {
+		/* a block is the number of bytes up to the next zero (+1),
+		 * followed by these bytes. the zero itself is implied. */
+		for (j=i; j<n && j-i<BLOCK_MAX; j++)
+			if (frame_byte(buf, len, crc, j) == 0) break;
+
+		err |= put(j-i+1);
+		for (k=i; k<j; k++)
+			err |= put(frame_byte(buf, len, crc, k));
+
+		if (j == n) break;
+		/* full blocks have no implied zero */
+		if (j-i < BLOCK_MAX) j++;
+		i = j;
+	}
+	err |= put(0);
+
+	return err;
+}
+
+void
+frame_decoder_init(frame_decoder_t *d, uint8_t *buf, uint8_t size)
+{
+	d->buf = buf;
+	d->size = size;
+	d->len = 0;
+	d->remaining = 0;
+	d->code = 0;
+	d->error = 0;
+	d->crc = 0;
+}
+
+static inline void
+frame_store(frame_decoder_t *d, uint8_t c)
+{
+	if (d->len >= d->size) {
+		d->error = FRAME_ERROR_OVERFLOW;
+		return;
+	}
+	d->buf[d->len++] = c;
+	d->crc = _crc_xmodem_update(d->crc, c);
+}
+
+uint8_t
+frame_decode(frame_decoder_t *d, uint8_t c)
+{
+	uint8_t ret;
+
+	if (c == 0) {
+		/* end of frame, ignore delimiters between frames */
+		if (d->code == 0) return FRAME_INCOMPLETE;
+
+		if (d->error)
+			ret = d->error;
+		else if (d->remaining)
+			ret = FRAME_ERROR_FORMAT;
+		else if (d->len < FRAME_CRC_SIZE || d->crc != 0)
+			ret = FRAME_ERROR_CRC;
+		else
+			ret = FRAME_OK;
+
+		/* the zero implied by the last block is not part of the frame,
+		 * strip the crc and keep the payload until the next frame */
+		if (ret == FRAME_OK)
+			d->len -= FRAME_CRC_SIZE;
+		else
+			d->len = 0;
+		d->code = 0;
+		d->remaining = 0;
+		return ret;
+	}
+
+	if (d->remaining) {
+		frame_store(d, c);
+		d->remaining--;
+		return FRAME_INCOMPLETE;
+	}
+
+	if (d->code == 0) {
+		/* first byte of a new frame */
+		d->len = 0;
+		d->error = 0;
+		d->crc = 0;
+	} else if (d->code < BLOCK_MAX+1) {
+		/* the previous block ended with a zero */
+		frame_store(d, 0);
+	}
+	d->code = c;
+	d->remaining = c - 1;
+
+	return FRAME_INCOMPLETE;
+}
+
+uint8_t
+frame_receive(frame_decoder_t *d, frame_getc_t get)
+{
+	char c;
+	uint8_t ret;
+
+	while (get(&c) == 0) {
+		ret = frame_decode(d, c);
+		if (ret != FRAME_INCOMPLETE) return ret;
+	}
+	return FRAME_INCOMPLETE;
+}
@@ -0,0 +1,85 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stdint.h>
+
+/*
+ * binary packets over a byte stream (uart, usi_uart, ...)
+ *
+ * the payload plus a crc-16 (xmodem/ccitt polynom 0x1021, high byte
+ * first) is COBS encoded and terminated by a 0x00 byte. COBS adds one
+ * byte per 254 payload bytes, 0x00 never occurs inside a frame, so the
+ * receiver resynchronizes at the next 0x00 after garbage.
+ */
+
+/* bytes added by the crc */
+#define FRAME_CRC_SIZE 2
+
+/* maximum payload of one frame */
+#define FRAME_MAX_PAYLOAD 253
+
+/* receive buffer size needed for frames with up to 'payload' bytes */
+#define FRAME_BUFFER_SIZE(payload) ((payload)+FRAME_CRC_SIZE)
+
+/* return values of frame_decode() and frame_receive() */
+#define FRAME_INCOMPLETE        0
+#define FRAME_OK                1
+#define FRAME_ERROR_CRC         2
+#define FRAME_ERROR_OVERFLOW    3
+#define FRAME_ERROR_FORMAT      4
+
+/* byte output function, eg uart_putc or usi_uart_sendc.
+ * returns non-zero on error */
+typedef uint8_t (*frame_putc_t)(char c);
+
+/* byte input function, eg uart_getc or usi_uart_recvc.
+ * returns non-zero if no byte is available */
+typedef uint8_t (*frame_getc_t)(char *c);
+
+typedef struct {
+	uint8_t *buf;       /* decoded payload (and crc) */
+	uint8_t size;
+	uint8_t len;        /* payload length after FRAME_OK */
+	uint8_t remaining;  /* data bytes left in the current block */
+	uint8_t code;       /* code byte of the current block, 0: no frame */
+	uint8_t error;
+	uint16_t crc;
+} frame_decoder_t;
+
+
+/*
+ * encodes 'len' bytes from 'buf' (up to FRAME_MAX_PAYLOAD) and sends the
+ * frame byte by byte with 'put'. the payload is not copied, the encoder
+ * scans it in place.
+ *
+ * returns non-zero if 'put' failed for any byte
+ */
+uint8_t frame_send(frame_putc_t put, const uint8_t *buf, uint8_t len);
+
+/*
+ * sets up a decoder that stores frames in 'buf' of 'size' bytes.
+ * use FRAME_BUFFER_SIZE() for 'size', the crc is stored too.
+ */
+void frame_decoder_init(frame_decoder_t *d, uint8_t *buf, uint8_t size);
+
+/*
+ * feeds one received byte into the decoder. the payload is decoded and
+ * the crc updated on the fly, when the terminating 0x00 arrives only
+ * the crc result is checked.
+ *
+ * returns FRAME_OK when a complete frame with a valid crc was received,
+ * the payload is in d->buf, its length in d->len (valid until the next
+ * frame starts). returns one of FRAME_ERROR_* for a broken frame and
+ * FRAME_INCOMPLETE otherwise.
+ */
+uint8_t frame_decode(frame_decoder_t *d, uint8_t c);
+
+/*
+ * feeds bytes from 'get' into the decoder until a frame is complete
+ * (or broken) or no more input is available. never blocks.
+ *
+ * returns like frame_decode()
+ */
+uint8_t frame_receive(frame_decoder_t *d, frame_getc_t get);
+
+#endif
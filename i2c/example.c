@@ -1,3 +1,4 @@
+#include <avr/interrupt.h>
 #include <util/delay.h>
 #include "i2c-master.h"
 
@@ -6,8 +7,16 @@ int main()
 {
 	int8_t ret;
 	uint8_t data[] = { 0x00, 0x01, 0x02 };
+	uint8_t reg1 = 0x01, reg2 = 0x02;
+	uint8_t value1[2], value2[2];
+	i2c_transaction_t read1 = {
+		.addr = 0x40, .wbuf = &reg1, .wlen = 1, .rbuf = value1, .rlen = 2 };
+	i2c_transaction_t read2 = {
+		.addr = 0x40, .wbuf = &reg2, .wlen = 1, .rbuf = value2, .rlen = 2 };
 
 	i2c_master_init();
+	sei();
+
 	while (1) {
 
 		/* write 0 bytes (ie nothing) to device 0x00
@@ -30,6 +39,25 @@ int main()
 			/* error case */
 		}
 
+		/* write 1 byte (eg a register address) and read 2 bytes
+		 * from slave 0x40 with a repeated start in between */
+		ret = i2c_master_write_read(0x40, data, 1, data+1, 2);
+		if (ret != 0) {
+			/* error case */
+		}
+
+		/* read two registers of slave 0x40 in the background */
+		i2c_master_queue(&read1);
+		i2c_master_queue(&read2);
+
+		while (i2c_master_busy()) {
+			/* do something else meanwhile */
+		}
+
+		if (read1.status != I2C_DONE || read2.status != I2C_DONE) {
+			/* error case, see read1.error and read2.error */
+		}
+
 		_delay_ms(2000);
 	}
 }
@@ -1,113 +1,398 @@
+#include <stddef.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+#include <util/delay.h>
+
 #include "i2c-master.h"
+#include "../common/ringbuf.h"
+
+#define QUEUE_MASK (I2C_QUEUE_SIZE-1)
+
+RINGBUF_CHECK_SIZE(I2C_QUEUE_SIZE, I2C_QUEUE_SIZE);
+
+/* TWCR values */
+#define TWCR_START		((1<<TWINT) | (1<<TWSTA) | (1<<TWEN) | (1<<TWIE))
+#define TWCR_CONTINUE	((1<<TWINT) | (1<<TWEN) | (1<<TWIE))
+#define TWCR_ACK		((1<<TWINT) | (1<<TWEA) | (1<<TWEN) | (1<<TWIE))
+#define TWCR_NACK		TWCR_CONTINUE
+#define TWCR_STOP		((1<<TWINT) | (1<<TWSTO) | (1<<TWEN))
+/* stop, then start the next transaction */
+#define TWCR_STOP_START	((1<<TWINT) | (1<<TWSTO) | (1<<TWSTA) | (1<<TWEN) | (1<<TWIE))
 
 
 static uint8_t last_error = 0;
 
+/* queued transactions, the one at head is running. written by
+ * i2c_master_queue() (tail) and the twi interrupt (head) */
+static i2c_transaction_t *queue[I2C_QUEUE_SIZE];
+static ringbuf_t q;
+
+/* position in the buffer of the current phase */
+static uint8_t pos;
+/* current phase is reading */
+static uint8_t reading;
+/* retries of the current transaction after lost arbitration */
+static uint8_t retries;
+/* set while the twi interrupt works through the queue, only
+ * i2c_master_queue() starts it when it is not set */
+static volatile uint8_t running;
+/* counts twi events, the blocking functions watch it for progress */
+static volatile uint8_t events;
+/* microseconds without an event until the bus counts as stuck,
+ * depends on the clock */
+static uint32_t timeout_us;
+
 void
 i2c_master_init()
 {
-	/* no clock prescaler */
-	TWSR = 0;
+	/* a slave may still hold the bus if only the controller was reset */
+	i2c_master_recover();
+
 	/* set SCL frequency */
-	TWBR = (F_CPU/F_SCL - 16)/2;
+	i2c_master_set_clock(F_SCL);
+
+	ringbuf_init(&q);
 }
 
-static uint8_t
-i2c_master_start(uint8_t slave_addr, uint8_t data_direction)
+uint32_t
+i2c_master_set_clock_runtime(uint32_t hz)
 {
-	/* send start condition */
-	TWCR = (1<<TWINT) | (1<<TWSTA) | (1<<TWEN);
-	/* wait for transmission */
-	while (!(TWCR & (1<<TWINT))) ;
-
-	/* return on error */
-	if (TW_STATUS != TW_START && TW_STATUS != TW_REP_START) {
-		last_error = TW_STATUS;
-		return 1;
-	}
+	uint32_t div;
+	uint8_t ps;
 
-	/* send slave address and data direction */
-	TWDR = (slave_addr<<1) | data_direction;
-	TWCR = (1<<TWINT) | (1<<TWEN);
-	/* wait for transmission */
-	while (!(TWCR & (1<<TWINT))) ;
+	if (hz > I2C_CLOCK_MAX)
+		hz = I2C_CLOCK_MAX;
+	if (hz < I2C_CLOCK_MIN)
+		hz = I2C_CLOCK_MIN;
 
-	/* return on error */
-	if (TW_STATUS != TW_MT_SLA_ACK && TW_STATUS != TW_MR_SLA_ACK) {
-		last_error = TW_STATUS;
-		return 1;
-	}
+	/* SCL = F_CPU / (16 + 2 * TWBR * 4^TWPS), round the divider up
+	 * so the clock is never faster than requested */
+	div = ((F_CPU) + hz - 1) / hz;
+	div = div > 16 ? (div - 16 + 1) / 2 : 0;
+	if (div < I2C_TWBR_MIN)
+		div = I2C_TWBR_MIN;
 
-	/* success, we are now in master-tx/master-rx mode */
-	return 0;
+	/* smallest prescaler that fits, for the finest steps */
+	for (ps = 0; ps < 3 && div > 255; ps++)
+		div = (div + 3) / 4;
+	if (div > 255)
+		div = 255;
+
+	TWSR = ps;
+	TWBR = div;
+	hz = (F_CPU) / (16 + 2 * div * (1UL << (2*ps)));
+
+	/* a byte takes nine clocks (with the ack) */
+	timeout_us = I2C_TIMEOUT_BYTES * 9 * 1000000UL / hz + I2C_STRETCH_US;
+
+	return hz;
 }
 
+/* sends a start condition for the transaction at the head of the queue */
 static void
-i2c_master_stop()
+i2c_master_start()
 {
-	/* send stop contition */
-	TWCR = (1<<TWINT) | (1<<TWSTO) | (1<<TWEN);
-	/* wait for transmission (TWI clears TWSTO bit) */
-	while (TWCR & (1<<TWSTO)) ;
+	uint32_t n;
+
+	/* the stop condition of the last transaction may not be done.
+	 * if it never is, the transaction times out */
+	for (n = timeout_us; (TWCR & (1<<TWSTO)) && n; n--)
+		_delay_us(1);
+
+	TWCR = TWCR_START;
+}
+
+/* removes the current transaction from the queue, releases the bus
+ * and starts the next transaction (if any) */
+static void
+i2c_master_finish(i2c_transaction_t *t, uint8_t status, uint8_t stop)
+{
+	ringbuf_read_commit(&q, QUEUE_MASK, 1);
+	retries = 0;
+
+	/* first, the callback may queue the next transaction. the twi
+	 * holds SCL low until TWINT is cleared below */
+	t->status = status;
+	if (t->callback)
+		t->callback(t);
+
+	if (!ringbuf_empty(&q)) {
+		/* after arbitration loss the bus is released already, the
+		 * start condition is sent as soon as it is free */
+		TWCR = stop ? TWCR_STOP_START : TWCR_START;
+	} else {
+		TWCR = stop ? TWCR_STOP : (1<<TWINT) | (1<<TWEN);
+		running = 0;
+	}
+}
+
+/* handles one twi event of the current transaction */
+static void
+i2c_master_step()
+{
+	i2c_transaction_t *t = queue[q.head];
+	uint8_t status = TW_STATUS;
+
+	events++;
+
+	switch (status) {
+		case TW_START:
+		case TW_REP_START:
+			/* write phase first, read after a repeated start */
+			reading = (status == TW_REP_START) || (t->wlen == 0 && t->rlen != 0);
+			pos = 0;
+			TWDR = (t->addr<<1) | (reading ? I2C_READ : I2C_WRITE);
+			TWCR = TWCR_CONTINUE;
+			break;
+
+		case TW_MT_SLA_ACK:
+		case TW_MT_DATA_ACK:
+			if (pos < t->wlen) {
+				TWDR = t->wbuf[pos++];
+				TWCR = TWCR_CONTINUE;
+			} else if (t->rlen != 0) {
+				/* repeated start for the read phase */
+				TWCR = TWCR_START;
+			} else {
+				i2c_master_finish(t, I2C_DONE, 1);
+			}
+			break;
+
+		case TW_MR_DATA_ACK:
+			t->rbuf[pos++] = TWDR;
+			/* fall through */
+		case TW_MR_SLA_ACK:
+			/* respond to the last byte with nack */
+			if (pos + 1 < t->rlen)
+				TWCR = TWCR_ACK;
+			else
+				TWCR = TWCR_NACK;
+			break;
+
+		case TW_MR_DATA_NACK:
+			t->rbuf[pos++] = TWDR;
+			i2c_master_finish(t, I2C_DONE, 1);
+			break;
+
+		case TW_MT_ARB_LOST:
+			/* another master took the bus, no stop condition.
+			 * the twi starts again once the bus is free */
+			if (retries < I2C_ARB_RETRIES) {
+				retries++;
+				TWCR = TWCR_START;
+				break;
+			}
+			t->error = status;
+			i2c_master_finish(t, I2C_FAILED, 0);
+			break;
+
+		default:
+			/* no ack or bus error */
+			t->error = status;
+			i2c_master_finish(t, I2C_FAILED, 1);
+			break;
+	}
+}
+
+ISR(TWI_vect)
+{
+	i2c_master_step();
 }
 
 uint8_t
-i2c_master_send(uint8_t slave_addr, uint8_t *data, uint8_t len)
+i2c_master_queue(i2c_transaction_t *t)
 {
-	int8_t ret;
+	uint8_t ret = 1, start = 0;
 
-	ret = i2c_master_start(slave_addr, I2C_WRITE);
-	if (ret != 0) {
-		i2c_master_stop();
-		return 1;
+	/* the main program and the callbacks may queue, the free check
+	 * and the write must not be interrupted */
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		if (ringbuf_free(&q, QUEUE_MASK) != 0) {
+			t->status = I2C_PENDING;
+			t->error = 0;
+			queue[q.tail] = t;
+			ringbuf_write_commit(&q, QUEUE_MASK, 1);
+			ret = 0;
+
+			/* the interrupt starts queued transactions by itself */
+			if (!running) {
+				running = 1;
+				start = 1;
+			}
+		}
 	}
 
-	while (len--) {
-		TWDR = *data++;
-		TWCR = (1<<TWINT) | (1<<TWEN);
+	/* waits for the last stop condition, interrupts stay enabled */
+	if (start)
+		i2c_master_start();
+
+	return ret;
+}
 
-		while (!(TWCR & (1<<TWINT))) ;
-		if (TW_STATUS != TW_MT_DATA_ACK) {
-			last_error = TW_STATUS;
-			i2c_master_stop();
-			return 1;
+uint8_t
+i2c_master_busy()
+{
+	return !ringbuf_empty(&q);
+}
+
+void
+i2c_master_abort()
+{
+	i2c_transaction_t *t = NULL;
+	uint8_t start = 0;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		/* twi off, drops the current transfer */
+		TWCR = 0;
+
+		if (!ringbuf_empty(&q)) {
+			t = queue[q.head];
+			ringbuf_read_commit(&q, QUEUE_MASK, 1);
+			t->error = I2C_ERROR_TIMEOUT;
+			t->status = I2C_FAILED;
 		}
+		retries = 0;
+		/* nothing is started while the bus is recovered */
+		running = 1;
 	}
 
-	i2c_master_stop();
-	return 0;
+	i2c_master_recover();
+
+	if (t && t->callback)
+		t->callback(t);
+
+	/* the remaining transactions (and the ones the callback queued) */
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		if (ringbuf_empty(&q))
+			running = 0;
+		else
+			start = 1;
+	}
+
+	if (start)
+		i2c_master_start();
 }
 
 uint8_t
-i2c_master_recv(uint8_t slave_addr, uint8_t *buffer, uint8_t len)
+i2c_master_recover()
 {
-	int8_t ret;
+#ifdef I2C_SCL_PIN
+	uint8_t i, pullups = I2C_PORT & ((1<<I2C_SCL_PIN) | (1<<I2C_SDA_PIN));
+
+	/* twi off, both lines are released (input, no pull-up) and only
+	 * pulled low by switching them to output */
+	TWCR = 0;
+	I2C_PORT &= ~((1<<I2C_SCL_PIN) | (1<<I2C_SDA_PIN));
+	I2C_DDR &= ~((1<<I2C_SCL_PIN) | (1<<I2C_SDA_PIN));
+	_delay_us(5);
+
+	/* clock until the slave releases SDA */
+	for (i = 0; i < 9 && !(I2C_PIN & (1<<I2C_SDA_PIN)); i++) {
+		I2C_DDR |= (1<<I2C_SCL_PIN);
+		_delay_us(5);
+		I2C_DDR &= ~(1<<I2C_SCL_PIN);
+		_delay_us(5);
+	}
+
+	/* stop condition: SDA goes high while SCL is high */
+	I2C_DDR |= (1<<I2C_SCL_PIN);
+	_delay_us(5);
+	I2C_DDR |= (1<<I2C_SDA_PIN);
+	_delay_us(5);
+	I2C_DDR &= ~(1<<I2C_SCL_PIN);
+	_delay_us(5);
+	I2C_DDR &= ~(1<<I2C_SDA_PIN);
+	/* the pull-ups of the application, if any */
+	I2C_PORT |= pullups;
+	_delay_us(5);
 
-	ret = i2c_master_start(slave_addr, I2C_READ);
-	if (ret != 0) {
-		i2c_master_stop();
+	if (!(I2C_PIN & (1<<I2C_SCL_PIN)) || !(I2C_PIN & (1<<I2C_SDA_PIN)))
 		return 1;
+#else
+	/* pins unknown, just reset the twi */
+	TWCR = 0;
+#endif
+	return 0;
+}
+
+/* queues 't' and waits until it is finished. works with disabled
+ * interrupts too, the twi is polled then. without any progress on the
+ * bus for the timeout the running transaction is aborted, that is 't'
+ * or one queued before it. */
+static uint8_t
+i2c_master_transfer(i2c_transaction_t *t)
+{
+	uint8_t queued = 0, seen = events;
+	uint32_t budget = timeout_us;
+
+	while (!queued || t->status == I2C_PENDING) {
+		if (!queued && i2c_master_queue(t) == 0) {
+			queued = 1;
+			continue;
+		}
+
+		if (!(SREG & (1<<SREG_I)) && (TWCR & (1<<TWINT)))
+			i2c_master_step();
+
+		if (events != seen) {
+			seen = events;
+			budget = timeout_us;
+		} else if (budget-- == 0) {
+			/* the bus is stuck, 't' must not stay queued when this
+			 * returns, it is on the stack */
+			i2c_master_abort();
+			budget = timeout_us;
+		} else {
+			_delay_us(1);
+		}
 	}
 
-	while (len-- > 1) {
-		/* receive one byte, respond with ack */
-		TWCR = (1<<TWINT) | (1<<TWEA) | (1<<TWEN);
-		/* wait for receiver */
-		while (!(TWCR & (1<<TWINT))) ;
-		/* write to buffer */
-		*buffer++ = TWDR;
+	if (t->status != I2C_DONE) {
+		last_error = t->error;
+		return 1;
 	}
 
-	/* receive last byte, respond with nack */
-	TWCR = (1<<TWINT) | (1<<TWEN);
-	/* wait for receiver */
-	while (!(TWCR & (1<<TWINT))) ;
-	/* write to buffer */
-	*buffer = TWDR;
+	return 0;
+}
 
-	i2c_master_stop();
+uint8_t
+i2c_master_send(uint8_t slave_addr, uint8_t *data, uint8_t len)
+{
+	i2c_transaction_t t = {
+		.addr = slave_addr,
+		.wbuf = data, .wlen = len,
+		.rbuf = NULL, .rlen = 0,
+		.callback = NULL,
+	};
 
-	return 0;
+	return i2c_master_transfer(&t);
+}
+
+uint8_t
+i2c_master_recv(uint8_t slave_addr, uint8_t *buffer, uint8_t len)
+{
+	i2c_transaction_t t = {
+		.addr = slave_addr,
+		.wbuf = NULL, .wlen = 0,
+		.rbuf = buffer, .rlen = len,
+		.callback = NULL,
+	};
+
+	return i2c_master_transfer(&t);
+}
+
+uint8_t
+i2c_master_write_read(uint8_t slave_addr, const uint8_t *wbuf, uint8_t wlen,
+		uint8_t *rbuf, uint8_t rlen)
+{
+	i2c_transaction_t t = {
+		.addr = slave_addr,
+		.wbuf = wbuf, .wlen = wlen,
+		.rbuf = rbuf, .rlen = rlen,
+		.callback = NULL,
+	};
+
+	return i2c_master_transfer(&t);
 }
 
 uint8_t
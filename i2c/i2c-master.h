@@ -3,17 +3,148 @@
 
 #include <util/twi.h>
 
-/* i2c clock frequency in Hz, normal mode: 100kHz */
+#ifndef F_CPU
+#error "F_CPU is not defined"
+#endif
+
+/* i2c clock frequency in Hz set by i2c_master_init(),
+ * normal mode: 100kHz, fast mode: 400kHz */
+#ifndef F_SCL
 #define F_SCL 100000
+#endif
+
+/* smallest TWBR in master mode, the twi of the older megas does not
+ * work reliably below 10 (see the TWBR description in their datasheets) */
+#if defined(__AVR_ATmega8__) || defined(__AVR_ATmega16__) || \
+	defined(__AVR_ATmega32__) || defined(__AVR_ATmega8535__)
+#define I2C_TWBR_MIN 10
+#else
+#define I2C_TWBR_MIN 0
+#endif
+
+/* range of i2c_master_set_clock(): I2C_TWBR_MIN and fast mode at most,
+ * TWBR=255 with prescaler 64 at least */
+#define I2C_TWBR_MIN_CLOCK (((F_CPU) + 16 + 2*I2C_TWBR_MIN - 1) / \
+		(16 + 2*I2C_TWBR_MIN))
+#define I2C_CLOCK_MAX (I2C_TWBR_MIN_CLOCK < 400000 ? I2C_TWBR_MIN_CLOCK : 400000)
+#define I2C_CLOCK_MIN ((F_CPU)/(16 + 2*255*64UL) + 1)
 
 #define I2C_READ TW_READ
 #define I2C_WRITE TW_WRITE
 
+/* number of transactions that can be queued, must be a power of 2.
+ * one entry is always kept free. */
+#ifndef I2C_QUEUE_SIZE
+#define I2C_QUEUE_SIZE 8
+#endif
+
+/* the blocking functions give up when nothing happened on the bus
+ * for I2C_TIMEOUT_BYTES byte times at the clock set plus
+ * I2C_STRETCH_US, the longest a slave may hold SCL low (at least, the
+ * actual time is longer). the running transaction is failed with
+ * i2c_master_abort(). */
+#ifndef I2C_TIMEOUT_BYTES
+#define I2C_TIMEOUT_BYTES 4
+#endif
+
+#ifndef I2C_STRETCH_US
+#define I2C_STRETCH_US 1000
+#endif
+
+/* after lost arbitration a transaction is started again up to
+ * I2C_ARB_RETRIES times, the twi sends the start condition as soon
+ * as the other master released the bus */
+#ifndef I2C_ARB_RETRIES
+#define I2C_ARB_RETRIES 3
+#endif
+
+/* SCL and SDA pins for i2c_master_recover(), defaults for the twi pins
+ * of some controllers. without them the bus is not clocked. */
+#ifndef I2C_SCL_PIN
+#if defined(__AVR_ATmega8__) || defined(__AVR_ATmega48__) || \
+	defined(__AVR_ATmega88__) || defined(__AVR_ATmega168__) || \
+	defined(__AVR_ATmega328P__)
+#define I2C_PORT PORTC
+#define I2C_DDR DDRC
+#define I2C_PIN PINC
+#define I2C_SCL_PIN PC5
+#define I2C_SDA_PIN PC4
+#elif defined(__AVR_ATmega16__) || defined(__AVR_ATmega32__) || \
+	defined(__AVR_ATmega8535__) || defined(__AVR_ATmega644__) || \
+	defined(__AVR_ATmega164P__) || defined(__AVR_ATmega324P__) || \
+	defined(__AVR_ATmega644P__) || defined(__AVR_ATmega1284P__)
+#define I2C_PORT PORTC
+#define I2C_DDR DDRC
+#define I2C_PIN PINC
+#define I2C_SCL_PIN PC0
+#define I2C_SDA_PIN PC1
+#endif
+#endif
+
+/* transaction status */
+#define I2C_DONE	0
+#define I2C_PENDING	1
+#define I2C_FAILED	2
+
+/* error code for a timeout, in addition to the status codes
+ * from <util/twi.h> */
+#define I2C_ERROR_TIMEOUT 0x01
+
+/*
+ * one transaction: write 'wlen' bytes from 'wbuf' to the slave, then
+ * read 'rlen' bytes into 'rbuf' (after a repeated start). either
+ * length may be 0, with both 0 only the address is sent (write).
+ *
+ * the descriptor and the buffers must stay valid until 'status' is no
+ * longer I2C_PENDING.
+ */
+typedef struct i2c_transaction {
+	uint8_t addr;
+	const uint8_t *wbuf;
+	uint8_t wlen;
+	uint8_t *rbuf;
+	uint8_t rlen;
+	/* called from the interrupt when the transaction is finished (may
+	 * be NULL), before the bus is released, or from i2c_master_abort().
+	 * must be short, it may queue the next transaction with
+	 * i2c_master_queue(). */
+	void (*callback)(struct i2c_transaction *t);
+	/* set by the library */
+	volatile uint8_t status;
+	uint8_t error;		/* status code from <util/twi.h> if I2C_FAILED */
+} i2c_transaction_t;
+
 /*
  * setup hardware/library, call once before send/recv.
  */
 void i2c_master_init();
 
+/*
+ * same as i2c_master_set_clock() without the compile-time check
+ */
+uint32_t i2c_master_set_clock_runtime(uint32_t hz);
+
+/* never defined, only referenced for constants out of range */
+extern uint32_t i2c_master_clock_out_of_range(void)
+	__attribute__((error("i2c clock out of range, see I2C_CLOCK_MIN/MAX")));
+
+/*
+ * set the i2c clock frequency to 'hz'. picks the TWI prescaler and
+ * TWBR for the closest frequency that is not above 'hz' (within
+ * I2C_CLOCK_MIN and I2C_CLOCK_MAX). constant values out of range are
+ * rejected at compile time. don't call while a transaction is running.
+ *
+ * returns the frequency that was actually set
+ */
+static inline uint32_t
+i2c_master_set_clock(uint32_t hz)
+{
+	if (__builtin_constant_p(hz) && (hz < I2C_CLOCK_MIN || hz > I2C_CLOCK_MAX))
+		return i2c_master_clock_out_of_range();
+
+	return i2c_master_set_clock_runtime(hz);
+}
+
 /*
  * send 'len' bytes from 'data' to 'slave_addr'
  *
@@ -28,10 +159,56 @@ uint8_t i2c_master_send(uint8_t slave_addr, uint8_t *data, uint8_t len);
  */
 uint8_t i2c_master_recv(uint8_t slave_addr, uint8_t *buffer, uint8_t len);
 
+/*
+ * send 'wlen' bytes from 'wbuf' to 'slave_addr', then receive 'rlen'
+ * bytes into 'rbuf' after a repeated start (no stop in between, the
+ * bus is not released). eg for register reads: write the register
+ * address, read its content.
+ *
+ * return 0 on success, 1 on error
+ */
+uint8_t i2c_master_write_read(uint8_t slave_addr, const uint8_t *wbuf,
+		uint8_t wlen, uint8_t *rbuf, uint8_t rlen);
+
 /*
  * if send/recv returned unsuccessful, this gives the reason
  * the error code is one the status codes defined in <util/twi.h>
  */
 uint8_t i2c_master_last_error();
 
+/*
+ * queue a transaction, it is carried out by the twi interrupt in the
+ * background (interrupts must be enabled). 't->status' is I2C_PENDING
+ * until it finished with I2C_DONE or I2C_FAILED.
+ * may be called from the callback of a transaction too.
+ *
+ * returns 0 on success, 1 if the queue is full
+ */
+uint8_t i2c_master_queue(i2c_transaction_t *t);
+
+/*
+ * returns non-zero while transactions are queued or running
+ */
+uint8_t i2c_master_busy();
+
+/*
+ * stop the twi, fail the running transaction (I2C_FAILED with
+ * I2C_ERROR_TIMEOUT, its callback is called), free the bus with
+ * i2c_master_recover() and start the next queued transaction. the
+ * blocking functions do this on a timeout, use it when queued
+ * transactions don't finish in time.
+ */
+void i2c_master_abort();
+
+/*
+ * free a bus that is stuck because a slave holds SDA low (eg it was
+ * reset in the middle of a transfer): clock SCL up to nine times until
+ * SDA is released, then send a stop condition. the pull-ups of the pins
+ * are off meanwhile and restored afterwards. the twi must not be busy,
+ * see i2c_master_abort().
+ *
+ * returns 0 if both lines are high afterwards, 1 otherwise
+ */
+uint8_t i2c_master_recover();
+
 #endif
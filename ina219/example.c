@@ -9,8 +9,7 @@
 
 void print16(uint16_t word)
 {
-	uart_putb(word>>8);
-	uart_putb(word);
+	uart_printf_P(PSTR("%04X"), word);
 }
 
 void print_config(ina219_t *ina219)
@@ -18,11 +17,11 @@ void print_config(ina219_t *ina219)
 	uint16_t cfg;
 
 	if (ina219_read_config(ina219, &cfg) == 0) {
-		uart_puts("config: 0x");
+		uart_puts_PSTR("config: 0x");
 		print16(cfg);
 		uart_putc('\n');
 	} else {
-		uart_puts("read_config error\n");
+		uart_puts_PSTR("read_config error\n");
 	}
 }
 
@@ -39,6 +38,9 @@ int main()
 
 	/* initialize i2c lib */
 	i2c_master_init();
+	/* the ina219 supports fast mode, run as fast as the controller
+	 * allows (about 278kHz on a mega8 at 10MHz) */
+	i2c_master_set_clock(I2C_CLOCK_MAX);
 
 	/* one device with the default address of 0x40 */
 	ina219 = ina219_new(0x40);
@@ -47,7 +49,7 @@ int main()
 	if (ina219_reset(ina219) != 0) {
 		/* sth went wrong, we could investigate with
 		 * i2c_master_last_error() */
-		uart_puts("error\n");
+		uart_puts_PSTR("error\n");
 	}
 
 	/* to measure current and power, we need to calibrate the device:
@@ -57,7 +59,7 @@ int main()
 	if (ina219_calibrate(ina219, INA219_CALIBRATION_MAX_2A) == 0) {
 		/* calibration value was set */
 	} else {
-		uart_puts("error\n");
+		uart_puts_PSTR("error\n");
 	}
 
 	/* if we have a supply voltage of eg 12V, we can lower the voltage range
@@ -81,24 +83,24 @@ int main()
 
 		if (ina219_get_bus_voltage(ina219, &bus_mv) == 0) {
 			/* bus_mv holds a successful reading: the voltage at V- in mV */
-			uart_puts("bv: "); print16(bus_mv); uart_putc('\n');
+			uart_puts_PSTR("bv: "); print16(bus_mv); uart_putc('\n');
 		}
 
 		if (ina219_get_shunt_voltage(ina219, &shunt_mv) == 0) {
 			/* shunt_mv holds the voltage drop over the shunt in mV */
-			uart_puts("sv: "); print16(shunt_mv); uart_putc('\n');
+			uart_puts_PSTR("sv: "); print16(shunt_mv); uart_putc('\n');
 		}
 
 		if (ina219_get_current(ina219, &current_ma) == 0) {
 			/* current_ma holds the current through the shunt in mA */
-			uart_puts("c:  "); print16(current_ma); uart_putc('\n');
+			uart_puts_PSTR("c:  "); print16(current_ma); uart_putc('\n');
 		}
 
 		_delay_ms(50);
 
 		if (ina219_get_power(ina219, &power_mw) == 0) {
 			/* power_mw holds the calculated power in mW */
-			uart_puts("p:  "); print16(power_mw); uart_putc('\n');
+			uart_puts_PSTR("p:  "); print16(power_mw); uart_putc('\n');
 		}
 
 		uart_putc('\n');
@@ -11,14 +11,8 @@ ina219_read_register(ina219_t *ina219, uint8_t reg, uint16_t *dest)
 {
 	uint8_t ret, buf[2];
 
-	/* write device register pointer */
-	ret = i2c_master_send(ina219->addr, &reg, 1);
-	if (ret != 0) {
-		return ret;
-	}
-
-	/* read content of 2-byte register */
-	ret = i2c_master_recv(ina219->addr, buf, 2);
+	/* write device register pointer, read content of 2-byte register */
+	ret = i2c_master_write_read(ina219->addr, &reg, 1, buf, 2);
 	if (ret != 0) {
 		return ret;
 	}
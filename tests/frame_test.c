@@ -0,0 +1,357 @@
+/*
+ * Test of the COBS/CRC-16 framing in frame/frame.c on the host.
+ *
+ * round trips: every payload length from 0 to FRAME_MAX_PAYLOAD with
+ *   random, all zero, all 0xff and random non-zero bytes, plus payloads
+ *   searched for: a crc with a zero low byte (trailing zero), a full
+ *   block of 254 bytes before it. the frame must not contain a zero
+ *   before the end, must not be longer than the COBS overhead allows
+ *   and must decode to the payload.
+ * corruption: every byte of a frame changed to another non-zero value,
+ *   the frame must not decode as FRAME_OK.
+ * errors: a zero inside a frame, a truncated block (FRAME_ERROR_FORMAT),
+ *   a frame too large for the buffer (FRAME_ERROR_OVERFLOW), garbage
+ *   and repeated delimiters; the decoder must pick up the next frame.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../frame/frame.c"
+
+/* payload, crc, a code byte per 254 bytes, the delimiter */
+#define FRAME_MAX (FRAME_MAX_PAYLOAD + FRAME_CRC_SIZE + 2 + 1)
+
+static uint8_t frame[FRAME_MAX + 1];
+static unsigned frame_len;
+
+/* output of frame_send() */
+static uint8_t
+put(char c)
+{
+	if (frame_len == sizeof(frame))
+		return 1;
+	frame[frame_len++] = c;
+	return 0;
+}
+
+/* input of frame_receive() */
+static const uint8_t *input;
+static unsigned input_n;
+
+static uint8_t
+get(char *c)
+{
+	if (input_n == 0)
+		return 1;
+	*c = *input++;
+	input_n--;
+	return 0;
+}
+
+static uint16_t
+crc(const uint8_t *buf, uint8_t len)
+{
+	uint16_t crc = 0;
+
+	while (len--)
+		crc = _crc_xmodem_update(crc, *buf++);
+	return crc;
+}
+
+static int
+fail(const char *what, uint8_t len)
+{
+	printf("  %s, %u bytes payload: FAILED\n", what, len);
+	return 1;
+}
+
+/* feeds 'n' bytes, returns the result of the last one */
+static uint8_t
+decode(frame_decoder_t *d, const uint8_t *buf, unsigned n)
+{
+	uint8_t ret = FRAME_INCOMPLETE;
+
+	while (n--)
+		ret = frame_decode(d, *buf++);
+	return ret;
+}
+
+/* encodes and decodes 'payload', returns the number of errors */
+static int
+round_trip(const char *what, const uint8_t *payload, uint8_t len)
+{
+	uint8_t buf[FRAME_BUFFER_SIZE(FRAME_MAX_PAYLOAD)];
+	frame_decoder_t d;
+	unsigned i, ret;
+
+	frame_len = 0;
+	if (frame_send(put, payload, len) != 0)
+		return fail(what, len);
+
+	if (frame_len > len + FRAME_CRC_SIZE + (len + FRAME_CRC_SIZE) / 254 + 2 ||
+			frame[frame_len - 1] != 0 || memchr(frame, 0, frame_len - 1))
+		return fail(what, len);
+
+	/* byte by byte with frame_decode() */
+	frame_decoder_init(&d, buf, sizeof(buf));
+	for (i = 0; i < frame_len - 1; i++)
+		if (frame_decode(&d, frame[i]) != FRAME_INCOMPLETE)
+			return fail(what, len);
+	ret = frame_decode(&d, 0);
+	if (ret != FRAME_OK || d.len != len || memcmp(buf, payload, len) != 0)
+		return fail(what, len);
+
+	/* the same through frame_receive(), in a buffer just large enough */
+	frame_decoder_init(&d, buf, FRAME_BUFFER_SIZE(len));
+	input = frame;
+	input_n = frame_len;
+	if (frame_receive(&d, get) != FRAME_OK || d.len != len ||
+			memcmp(buf, payload, len) != 0 || input_n != 0)
+		return fail(what, len);
+
+	return 0;
+}
+
+/* true if the last frame sent has a full block (code 0xff) */
+static int
+has_full_block(void)
+{
+	unsigned i;
+
+	/* follow the code bytes */
+	for (i = 0; i < frame_len - 1; i += frame[i])
+		if (frame[i] == 0xff)
+			return 1;
+	return 0;
+}
+
+static int
+round_trips(void)
+{
+	uint8_t payload[FRAME_MAX_PAYLOAD];
+	unsigned len, i, tries, found_trailing = 0, found_full = 0;
+	int errors = 0;
+
+	for (len = 0; len <= FRAME_MAX_PAYLOAD; len++) {
+		for (i = 0; i < len; i++)
+			payload[i] = rand();
+		errors += round_trip("random", payload, len);
+
+		memset(payload, 0, len);
+		errors += round_trip("all zero", payload, len);
+
+		memset(payload, 0xff, len);
+		errors += round_trip("all 0xff", payload, len);
+
+		for (i = 0; i < len; i++)
+			payload[i] = 1 + rand() % 255;
+		errors += round_trip("random non-zero", payload, len);
+	}
+
+	/* a crc with a zero low byte, so the frame ends in an implied zero */
+	for (len = 1; len <= FRAME_MAX_PAYLOAD; len += 18) {
+		for (tries = 0; tries < 1000000; tries++) {
+			for (i = 0; i < len; i++)
+				payload[i] = rand();
+			if ((crc(payload, len) & 0xff) == 0)
+				break;
+		}
+		if (tries == 1000000) {
+			errors += fail("no crc with a zero low byte", len);
+			continue;
+		}
+		found_trailing++;
+		errors += round_trip("trailing zero in the crc", payload, len);
+	}
+
+	/* 254 non-zero bytes in one block: 253 bytes payload and the high
+	 * byte of the crc, with and without a zero low byte */
+	for (tries = 0; tries < 1000000 && found_full < 2; tries++) {
+		for (i = 0; i < FRAME_MAX_PAYLOAD; i++)
+			payload[i] = 1 + rand() % 255;
+		if ((crc(payload, FRAME_MAX_PAYLOAD) >> 8) == 0)
+			continue;
+		if ((crc(payload, FRAME_MAX_PAYLOAD) & 0xff) != 0 && found_full == 1)
+			continue;
+
+		errors += round_trip("full block", payload, FRAME_MAX_PAYLOAD);
+		if (!has_full_block())
+			errors += fail("no full block", FRAME_MAX_PAYLOAD);
+		found_full++;
+	}
+	if (found_full != 2)
+		errors += fail("full block not found", FRAME_MAX_PAYLOAD);
+
+	printf("round trips, 0 to %u bytes, %u with a trailing zero, %u with a "
+			"full block: %s\n", FRAME_MAX_PAYLOAD, found_trailing, found_full,
+			errors ? "FAILED" : "ok");
+
+	return errors;
+}
+
+/* every byte of frames of some lengths changed to another non-zero
+ * value, the next frame must still be received */
+static int
+corruptions(void)
+{
+	static const uint8_t lens[] = { 0, 1, 2, 10, 100, 252, 253 };
+	uint8_t payload[FRAME_MAX_PAYLOAD], good[FRAME_MAX], buf[FRAME_BUFFER_SIZE(FRAME_MAX_PAYLOAD)];
+	unsigned l, i, len, good_len, n = 0, counts[5] = { 0 };
+	frame_decoder_t d;
+	uint8_t ret, old, bad;
+	int errors = 0;
+
+	/* a frame to follow the broken one */
+	frame_len = 0;
+	frame_send(put, (const uint8_t *)"next", 4);
+	memcpy(good, frame, frame_len);
+	good_len = frame_len;
+
+	for (l = 0; l < sizeof(lens); l++) {
+		len = lens[l];
+		for (i = 0; i < len; i++)
+			payload[i] = rand() % 4 ? rand() : 0;
+
+		frame_len = 0;
+		frame_send(put, payload, len);
+
+		for (i = 0; i < frame_len - 1; i++) {
+			old = frame[i];
+			for (bad = 1; bad; bad++) {
+				if (bad == old)
+					continue;
+				frame[i] = bad;
+
+				frame_decoder_init(&d, buf, sizeof(buf));
+				ret = decode(&d, frame, frame_len);
+				counts[ret]++;
+				n++;
+				if (ret == FRAME_OK)
+					errors += fail("corruption not detected", len);
+
+				if (decode(&d, good, good_len) != FRAME_OK || d.len != 4 ||
+						memcmp(buf, "next", 4) != 0)
+					errors += fail("no resync after corruption", len);
+			}
+			frame[i] = old;
+		}
+	}
+
+	printf("single byte corruptions: %u frames, %u incomplete, %u crc, "
+			"%u overflow, %u format errors: %s\n", n,
+			counts[FRAME_INCOMPLETE], counts[FRAME_ERROR_CRC],
+			counts[FRAME_ERROR_OVERFLOW], counts[FRAME_ERROR_FORMAT],
+			errors ? "FAILED" : "ok");
+
+	return errors;
+}
+
+static int
+expect(const char *what, uint8_t ret, uint8_t expected)
+{
+	if (ret == expected)
+		return 0;
+
+	printf("  %s: %u, expected %u: FAILED\n", what, ret, expected);
+	return 1;
+}
+
+/* garbage: any error, but not FRAME_OK or FRAME_INCOMPLETE */
+static int
+expect_error(const char *what, uint8_t ret)
+{
+	return expect(what, ret >= FRAME_ERROR_CRC, 1);
+}
+
+static int
+results(void)
+{
+	uint8_t payload[FRAME_MAX_PAYLOAD], buf[FRAME_BUFFER_SIZE(20)], next[16];
+	unsigned i, next_len;
+	frame_decoder_t d;
+	int errors = 0;
+
+	for (i = 0; i < sizeof(payload); i++)
+		payload[i] = 1 + i % 200;
+	frame_len = 0;
+	frame_send(put, (const uint8_t *)"ok", 2);
+	memcpy(next, frame, frame_len);
+	next_len = frame_len;
+
+	/* the payload limit */
+	frame_len = 0;
+	errors += expect("send of 254 bytes", frame_send(put, payload, 254), 1);
+	frame_len = sizeof(frame) - 10;
+	errors += expect("send to a full output", frame_send(put, payload, 20) != 0, 1);
+
+	/* too large for the buffer, then a frame that fits */
+	frame_decoder_init(&d, buf, sizeof(buf));
+	frame_len = 0;
+	frame_send(put, payload, 21);
+	errors += expect("overflow", decode(&d, frame, frame_len), FRAME_ERROR_OVERFLOW);
+	errors += expect("after overflow", decode(&d, next, next_len), FRAME_OK);
+
+	frame_len = 0;
+	frame_send(put, payload, 20);
+	errors += expect("largest frame for the buffer", decode(&d, frame, frame_len),
+			FRAME_OK);
+
+	/* a block cut short by the delimiter */
+	frame_len = 0;
+	frame_send(put, payload, 10);
+	frame[frame_len - 3] = 0;
+	errors += expect("truncated block", decode(&d, frame, frame_len - 2),
+			FRAME_ERROR_FORMAT);
+	/* the rest of it, then the next frame */
+	errors += expect_error("rest of the truncated frame",
+			decode(&d, frame + frame_len - 2, 2));
+	errors += expect("after truncated frame", decode(&d, next, next_len), FRAME_OK);
+
+	/* just a code byte, shorter than the crc */
+	errors += expect("code byte only", decode(&d, (const uint8_t *)"\x01", 2),
+			FRAME_ERROR_CRC);
+
+	/* delimiters between frames are ignored */
+	errors += expect("delimiters", decode(&d, (const uint8_t *)"\0\0\0", 3),
+			FRAME_INCOMPLETE);
+	errors += expect("after delimiters", decode(&d, next, next_len), FRAME_OK);
+
+	/* the receiver starts in the middle of a frame */
+	frame_len = 0;
+	frame_send(put, payload, 20);
+	frame_decoder_init(&d, buf, sizeof(buf));
+	errors += expect_error("second half of a frame",
+			decode(&d, frame + 10, frame_len - 10));
+	errors += expect("after half frame", decode(&d, next, next_len), FRAME_OK);
+	errors += expect("payload after half frame", d.len == 2 && memcmp(buf, "ok", 2) == 0, 1);
+
+	/* frame_receive() stops at the end of a frame and without input */
+	frame_decoder_init(&d, buf, sizeof(buf));
+	input = next;
+	input_n = next_len - 1;
+	errors += expect("receive without the delimiter", frame_receive(&d, get),
+			FRAME_INCOMPLETE);
+	input = next + next_len - 1;
+	input_n = 1;
+	errors += expect("receive the delimiter", frame_receive(&d, get), FRAME_OK);
+
+	printf("decoder results (overflow, format, resynchronisation): %s\n",
+			errors ? "FAILED" : "ok");
+
+	return errors;
+}
+
+int
+main()
+{
+	int errors = 0;
+
+	srand(1);
+	errors += round_trips();
+	errors += corruptions();
+	errors += results();
+
+	return errors != 0;
+}
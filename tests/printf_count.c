@@ -0,0 +1,118 @@
+/*
+ * Compares the work of uart_printf("%u") with itoa() + uart_puts(), the
+ * way the examples printed numbers before.
+ *
+ * The driver runs on the host against stub registers. The loop counts
+ * of uart_printf() are exact: every power of ten read from flash is
+ * counted by the pgm_read_dword() stub, every digit d took d
+ * subtractions. The avr-libc itoa()/ltoa() divide by ten with a shift
+ * and subtract loop of 16/32 steps per digit, that is counted from the
+ * number of digits.
+ *
+ * The cycle numbers are estimates: the loop counts times the cycles of
+ * the instructions in the loops (see CYC_*), there is no avr simulator
+ * here. The loop counts are what decides the comparison.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../uart/uart.c"
+
+/* per iteration of the loops */
+#define CYC_POW_READ	16	/* 4 lpm + address calculation */
+#define CYC_COMPARE		6	/* 4 cp/cpc + branch */
+#define CYC_SUBTRACT	7	/* 4 sub/sbc, inc, jump */
+#define CYC_TX_PUT		22	/* call of tx_put(), ringbuf_put() */
+#define CYC_DIV_STEP16	10	/* lsl, rol, rol, cp, brlo, sub, inc, dec, brne */
+#define CYC_DIV_STEP32	14	/* the same with 4 byte shifts */
+#define CYC_DIGIT		10	/* convert and store a digit */
+#define CYC_REVERSE		5	/* strrev() per character */
+#define CYC_SCAN		7	/* length loop of uart_puts() per character */
+#define CYC_COPY		7	/* memcpy() into the ring per character */
+/* per call */
+#define CYC_PRINTF		80	/* varargs, parsing "%u", tx_start() */
+#define CYC_PUTS		60	/* uart_puts(), uart_write(), tx_start() */
+
+void sim_sleep(void) {}
+void sim_delay(double seconds) {}
+
+typedef struct {
+	unsigned long numbers, chars;
+	unsigned long reads, compares, subtractions;	/* uart_printf() */
+	unsigned long steps;							/* itoa() */
+	double printf_cycles, itoa_cycles;
+} count_t;
+
+/* prints 'val' with uart_printf() and adds up the work */
+static void
+count(count_t *c, uint32_t val, uint8_t is_long)
+{
+	uint8_t n, i, digit;
+	unsigned long reads, subtractions = 0;
+
+	ringbuf_init(&txRing);
+	stub_lpm = 0;
+	if (is_long)
+		n = uart_printf("%lu", (unsigned long)val);
+	else
+		n = uart_printf("%u", (unsigned)val);
+	reads = stub_lpm / 4;
+
+	for (i = 0; i < n; i++) {
+		digit = txBuf[i] - '0';
+		subtractions += digit;
+	}
+
+	c->numbers++;
+	c->chars += n;
+	c->reads += reads;
+	c->subtractions += subtractions;
+	/* the last compare of every digit and the ones skipping zeros */
+	c->compares += subtractions + reads;
+	c->printf_cycles += reads * CYC_POW_READ + (subtractions + reads) * CYC_COMPARE +
+		subtractions * CYC_SUBTRACT + n * CYC_TX_PUT + CYC_PRINTF;
+
+	/* itoa(): one division per digit, then reverse, then uart_puts() */
+	c->steps += n * (is_long ? 32 : 16);
+	c->itoa_cycles += n * ((is_long ? 32 * CYC_DIV_STEP32 : 16 * CYC_DIV_STEP16) +
+			CYC_DIGIT + CYC_REVERSE + CYC_SCAN + CYC_COPY) + CYC_PUTS;
+}
+
+static void
+report(const char *name, count_t *c)
+{
+	double k = c->numbers;
+
+	printf("%s, %lu numbers, %.2f digits on average\n", name, c->numbers,
+			c->chars / k);
+	printf("  uart_printf:      %5.1f powers read, %5.1f compares, "
+			"%5.1f subtractions  ~%4.0f cycles\n", c->reads / k,
+			c->compares / k, c->subtractions / k, c->printf_cycles / k);
+	printf("  itoa + uart_puts: %5.1f division steps%32s~%4.0f cycles\n",
+			c->steps / k, "", c->itoa_cycles / k);
+}
+
+int
+main()
+{
+	count_t c16 = { 0 }, c32 = { 0 };
+	uint32_t v;
+	unsigned i;
+
+	uart_init();
+
+	/* every 16-bit value */
+	for (v = 0; v <= 0xffff; v++)
+		count(&c16, v, 0);
+	report("%u", &c16);
+
+	/* 32-bit values with evenly spread number of digits */
+	srand(1);
+	for (i = 0; i < 100000; i++) {
+		v = ((uint32_t)rand() << 16) ^ rand();
+		count(&c32, v >> (rand() % 32), 1);
+	}
+	report("%lu", &c32);
+
+	return 0;
+}
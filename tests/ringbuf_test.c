@@ -0,0 +1,200 @@
+/*
+ * Stress test of common/ringbuf.h on the host. A fast interval timer
+ * signal plays the role of the interrupt: it interrupts the main
+ * program at arbitrary points, also in the middle of the ring buffer
+ * functions, just like the uart interrupts do on the avr.
+ *
+ * rx: the signal handler writes bytes like the rx interrupt and drops
+ *     them if the buffer is full, the main program reads.
+ * tx: the main program writes and waits while the buffer is full, the
+ *     signal handler reads like the tx interrupt.
+ *
+ * Every mix of single byte and segment functions is run with several
+ * buffer sizes. Afterwards the bytes read must be exactly the bytes
+ * written minus the dropped ones, in the same order.
+ */
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "../common/ringbuf.h"
+
+#define BYTES 50000UL
+
+/* largest chunk of the segment functions */
+#define CHUNK 40
+
+static struct {
+	ringbuf_t r;
+	uint8_t buf[256];
+	uint8_t mask;
+	uint8_t bulk_write;		/* writer uses ringbuf_write() */
+	uint8_t bulk_read;		/* reader uses ringbuf_read() */
+
+	unsigned long written;	/* bytes offered by the writer */
+	unsigned long count;	/* bytes read */
+	uint8_t dropped[BYTES];	/* set if the byte was dropped */
+	uint8_t received[BYTES];	/* bytes in the order they were read */
+	unsigned seed;			/* chunk sizes of the interrupt side */
+	volatile sig_atomic_t done;
+} t;
+
+/* value of byte i, not just i & 0xff so a lost block of 256 is noticed */
+static uint8_t
+value(unsigned long i)
+{
+	return (i * 7) ^ (i >> 8);
+}
+
+/* chunk sizes, from a cheap generator */
+static uint8_t
+chunk(unsigned *seed)
+{
+	*seed = *seed * 1103515245 + 12345;
+	return 1 + ((*seed >> 16) % CHUNK);
+}
+
+/* writes up to 'n' bytes, returns the number written */
+static uint8_t
+write_bytes(uint8_t n)
+{
+	uint8_t tmp[CHUNK], k;
+
+	if (n > BYTES - t.written)
+		n = BYTES - t.written;
+
+	if (t.bulk_write) {
+		for (k = 0; k < n; k++)
+			tmp[k] = value(t.written + k);
+		k = ringbuf_write(&t.r, t.buf, t.mask, tmp, n);
+	} else {
+		for (k = 0; k < n; k++)
+			if (ringbuf_put(&t.r, t.buf, t.mask, value(t.written + k)) != 0)
+				break;
+	}
+
+	t.written += k;
+	return k;
+}
+
+/* reads up to 'n' bytes */
+static void
+read_bytes(uint8_t n)
+{
+	uint8_t k;
+
+	if (t.bulk_read) {
+		t.count += ringbuf_read(&t.r, t.buf, t.mask, t.received + t.count, n);
+	} else {
+		for (k = 0; k < n; k++)
+			if (ringbuf_get(&t.r, t.buf, t.mask, &t.received[t.count]) == 0)
+				t.count++;
+	}
+}
+
+/* the rx interrupt: stores a burst of bytes, drops what does not fit */
+static void
+rx_interrupt(int sig)
+{
+	uint8_t n, k;
+
+	if (t.written == BYTES) {
+		t.done = 1;
+		return;
+	}
+
+	n = chunk(&t.seed);
+	k = write_bytes(n);
+	for (; k < n && t.written < BYTES; k++)
+		t.dropped[t.written++] = 1;
+}
+
+/* the tx interrupt: takes a burst of bytes */
+static void
+tx_interrupt(int sig)
+{
+	read_bytes(chunk(&t.seed));
+}
+
+static void
+timer(void (*handler)(int), long usec)
+{
+	struct itimerval it = { { 0, usec }, { 0, usec } };
+
+	signal(SIGALRM, handler);
+	setitimer(ITIMER_REAL, &it, NULL);
+}
+
+/* returns the number of errors */
+static int
+run(int tx, unsigned size, uint8_t bulk_write, uint8_t bulk_read)
+{
+	unsigned long i, j = 0, dropped = 0;
+	unsigned seed = 2;
+	int errors = 0;
+
+	memset(&t, 0, sizeof(t));
+	t.mask = size - 1;
+	t.bulk_write = bulk_write;
+	t.bulk_read = bulk_read;
+	t.seed = 1;
+	ringbuf_init(&t.r);
+
+	if (tx) {
+		timer(tx_interrupt, 20);
+		while (t.written < BYTES)
+			write_bytes(chunk(&seed));
+		while (!ringbuf_empty(&t.r))
+			;
+	} else {
+		timer(rx_interrupt, 20);
+		while (!t.done || !ringbuf_empty(&t.r))
+			read_bytes(chunk(&seed));
+	}
+	timer(SIG_IGN, 0);
+
+	/* the bytes read must be the ones not dropped, in order */
+	for (i = 0; i < BYTES; i++) {
+		if (t.dropped[i]) {
+			dropped++;
+			continue;
+		}
+		if (j >= t.count) {
+			errors++;
+			break;
+		}
+		if (t.received[j] != value(i)) {
+			if (errors++ == 0)
+				printf("  byte %lu: read 0x%02x, expected 0x%02x\n", i,
+						t.received[j], value(i));
+		}
+		j++;
+	}
+	if (j != t.count)
+		errors++;
+
+	printf("%s size %3u, %s write, %s read: %lu read, %lu dropped, %s\n",
+			tx ? "tx" : "rx", size, bulk_write ? "bulk" : "byte",
+			bulk_read ? "bulk" : "byte", t.count, dropped,
+			errors ? "FAILED" : "ok");
+	fflush(stdout);
+
+	return errors;
+}
+
+int
+main()
+{
+	static const unsigned sizes[] = { 2, 16, 64, 256 };
+	unsigned s, mode;
+	int errors = 0;
+
+	for (s = 0; s < sizeof(sizes)/sizeof(sizes[0]); s++)
+		for (mode = 0; mode < 8; mode++)
+			errors += run(mode >> 2, sizes[s], mode & 1, (mode >> 1) & 1);
+
+	return errors != 0;
+}
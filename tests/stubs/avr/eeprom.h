@@ -0,0 +1,11 @@
+#ifndef STUB_AVR_EEPROM_H
+#define STUB_AVR_EEPROM_H
+
+#include <stdint.h>
+
+uint8_t eeprom[512];
+
+#define eeprom_read_byte(addr) (eeprom[(uintptr_t)(addr)])
+#define eeprom_update_byte(addr, value) (eeprom[(uintptr_t)(addr)] = (value))
+
+#endif
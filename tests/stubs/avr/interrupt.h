@@ -0,0 +1,12 @@
+#ifndef STUB_AVR_INTERRUPT_H
+#define STUB_AVR_INTERRUPT_H
+
+#include <avr/io.h>
+
+/* the tests call the interrupt routines directly */
+#define ISR(vector) void vector(void)
+
+#define cli() (SREG &= ~(1 << SREG_I))
+#define sei() (SREG |= (1 << SREG_I))
+
+#endif
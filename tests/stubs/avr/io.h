@@ -0,0 +1,128 @@
+/*
+ * Registers of the devices the host tests build the drivers for, as
+ * plain variables. Each test is a single translation unit that includes
+ * the driver source, so they are defined right here.
+ *
+ * Flag bits that are cleared by writing a one read as zero, the test
+ * keeps their real state elsewhere and looks for ones written by the
+ * driver, see usi_uart_bench.c.
+ */
+#ifndef STUB_AVR_IO_H
+#define STUB_AVR_IO_H
+
+#include <stdint.h>
+
+#define _BV(bit) (1 << (bit))
+
+volatile uint8_t SREG;
+#define SREG_I 7
+
+#if defined(__AVR_ATtiny85__)
+volatile uint8_t PORTB, DDRB, PINB;
+#define PB0 0
+#define PB1 1
+#define PB2 2
+#define PB3 3
+#define PB4 4
+#define PB5 5
+
+volatile uint8_t USIDR, USISR, USICR;
+#define USISIF 7
+#define USIOIF 6
+#define USIPF 5
+#define USIDC 4
+#define USISIE 7
+#define USIOIE 6
+#define USIWM1 5
+#define USIWM0 4
+#define USICS1 3
+#define USICS0 2
+#define USICLK 1
+#define USITC 0
+
+volatile uint8_t GIMSK, GIFR, PCMSK;
+#define INT0 6
+#define PCIE 5
+#define INTF0 6
+#define PCIF 5
+#define PCINT0 0
+
+volatile uint8_t TIMSK, TIFR;
+#define OCIE1A 6
+#define OCIE1B 5
+#define OCIE0A 4
+#define OCIE0B 3
+#define TOIE1 2
+#define TOIE0 1
+#define OCF1A 6
+#define OCF1B 5
+#define OCF0A 4
+#define OCF0B 3
+#define TOV1 2
+#define TOV0 1
+
+volatile uint8_t TCCR0A, TCCR0B, TCNT0, OCR0A, OCR0B;
+#define WGM01 1
+#define WGM00 0
+#define WGM02 3
+#define CS02 2
+#define CS01 1
+#define CS00 0
+
+volatile uint8_t TCCR1, TCNT1, OCR1A, OCR1B, OCR1C;
+#define CTC1 7
+#define PWM1A 6
+#define CS13 3
+#define CS12 2
+#define CS11 1
+#define CS10 0
+
+volatile uint8_t PLLCSR;
+#define LSM 7
+#define PCKE 2
+#define PLLE 1
+#define PLOCK 0
+
+volatile uint8_t OSCCAL;
+
+#elif defined(__AVR_ATmega8__)
+volatile uint8_t PORTD, DDRD, PIND;
+#define PD0 0
+#define PD1 1
+#define PD2 2
+#define PD3 3
+#define PD4 4
+#define PD5 5
+#define PD6 6
+#define PD7 7
+
+volatile uint8_t UDR, UCSRA, UCSRB, UCSRC, UBRRH, UBRRL;
+#define RXC 7
+#define TXC 6
+#define UDRE 5
+#define FE 4
+#define DOR 3
+#define PE 2
+#define U2X 1
+#define MPCM 0
+#define RXCIE 7
+#define TXCIE 6
+#define UDRIE 5
+#define RXEN 4
+#define TXEN 3
+#define UCSZ2 2
+#define RXB8 1
+#define TXB8 0
+#define URSEL 7
+#define UCSZ1 2
+#define UCSZ0 1
+
+volatile uint8_t MCUCR, GICR;
+#define ISC00 0
+#define INT0 6
+
+#else
+#error "device not supported by the test stubs"
+#endif
+
+#endif
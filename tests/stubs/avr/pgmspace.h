@@ -0,0 +1,19 @@
+#ifndef STUB_AVR_PGMSPACE_H
+#define STUB_AVR_PGMSPACE_H
+
+#include <stdint.h>
+#include <string.h>
+#include <avr/io.h>
+
+/* no separate flash on the host. the tests may look at the number of
+ * lpm instructions the reads would take */
+unsigned long stub_lpm;
+
+#define PROGMEM
+#define PSTR(s) (s)
+#define pgm_read_byte(addr) (stub_lpm += 1, *(const uint8_t *)(addr))
+#define pgm_read_dword(addr) (stub_lpm += 4, *(const uint32_t *)(addr))
+#define memcpy_P memcpy
+#define strlen_P strlen
+
+#endif
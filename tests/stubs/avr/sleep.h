@@ -0,0 +1,13 @@
+#ifndef STUB_AVR_SLEEP_H
+#define STUB_AVR_SLEEP_H
+
+/* provided by the test: returns after the next interrupt */
+void sim_sleep(void);
+
+#define SLEEP_MODE_IDLE 0
+#define set_sleep_mode(mode)
+#define sleep_enable()
+#define sleep_disable()
+#define sleep_cpu() sim_sleep()
+
+#endif
@@ -0,0 +1,14 @@
+#ifndef STUB_UTIL_ATOMIC_H
+#define STUB_UTIL_ATOMIC_H
+
+#include <avr/interrupt.h>
+
+/* like avr-libc, without the cleanup attribute: no return or break
+ * out of the block */
+#define ATOMIC_RESTORESTATE uint8_t sreg_save_ = SREG
+#define ATOMIC_FORCEON uint8_t sreg_save_ = SREG | (1 << SREG_I)
+#define ATOMIC_BLOCK(type) \
+	for (type, atomic_once_ = (cli(), 1); atomic_once_; \
+			SREG = sreg_save_, atomic_once_ = 0)
+
+#endif
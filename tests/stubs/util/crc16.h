@@ -0,0 +1,23 @@
+#ifndef STUB_UTIL_CRC16_H
+#define STUB_UTIL_CRC16_H
+
+#include <stdint.h>
+
+/* the c equivalent from the avr-libc documentation */
+static inline uint16_t
+_crc_xmodem_update(uint16_t crc, uint8_t data)
+{
+	uint8_t i;
+
+	crc ^= (uint16_t)data << 8;
+	for (i = 0; i < 8; i++) {
+		if (crc & 0x8000)
+			crc = (crc << 1) ^ 0x1021;
+		else
+			crc <<= 1;
+	}
+
+	return crc;
+}
+
+#endif
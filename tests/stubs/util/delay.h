@@ -0,0 +1,10 @@
+#ifndef STUB_UTIL_DELAY_H
+#define STUB_UTIL_DELAY_H
+
+/* provided by the test: lets 'seconds' pass */
+void sim_delay(double seconds);
+
+#define _delay_us(us) sim_delay((us) * 1e-6)
+#define _delay_ms(ms) sim_delay((ms) * 1e-3)
+
+#endif
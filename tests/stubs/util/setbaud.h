@@ -0,0 +1,10 @@
+#ifndef STUB_UTIL_SETBAUD_H
+#define STUB_UTIL_SETBAUD_H
+
+/* normal speed only, good enough for the tests */
+#define UBRR_VALUE (((F_CPU) + 8UL * (BAUD)) / (16UL * (BAUD)) - 1UL)
+#define UBRRL_VALUE (UBRR_VALUE & 0xff)
+#define UBRRH_VALUE (UBRR_VALUE >> 8)
+#define USE_2X 0
+
+#endif
@@ -0,0 +1,161 @@
+/*
+ * Test of the line detection of uart/uart.c on the host. The rx
+ * interrupt is called directly with the bytes of random lines, some of
+ * them longer than the input buffer. The main program takes them out
+ * with a random mix of uart_getc(), uart_read() and uart_read_line()
+ * with random sizes.
+ *
+ * Checked after every step:
+ * - uart_lines_available() is the number of delimiters in the buffer
+ * - uart_read_line() returns a line only if there is one, or the
+ *   buffer is full; a part without delimiter fills 'size' or the buffer
+ * - the line callback was called for every delimiter
+ * and at the end, that the bytes read are the bytes sent, in order.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../uart/uart.c"
+
+#define BYTES 200000UL
+
+/* longest line, the input buffer is RX_BUFFERSIZE */
+#define LINE_MAX (3 * RX_BUFFERSIZE)
+
+void sim_sleep(void) {}
+void sim_delay(double seconds) {}
+
+static uint8_t sent[BYTES], received[BYTES];
+static unsigned long n_sent, n_received, callbacks;
+
+static void
+line_callback(void)
+{
+	callbacks++;
+}
+
+/* the lines: printable characters, then the delimiter */
+static void
+make_lines(void)
+{
+	unsigned long i = 0;
+	unsigned len;
+
+	while (i < BYTES) {
+		len = rand() % (LINE_MAX + 1);
+		while (len-- && i < BYTES - 1)
+			sent[i++] = 'a' + rand() % 26;
+		sent[i++] = UART_LINE_DELIMITER;
+	}
+}
+
+/* the rx interrupt receives the next byte */
+static void
+receive(void)
+{
+	UDR = sent[n_sent++];
+	RX_COMPL_INT();
+}
+
+/* delimiters in the input buffer */
+static uint8_t
+lines_buffered(void)
+{
+	uint8_t i, n = 0;
+
+	for (i = rxRing.head; i != rxRing.tail; i = (i + 1) & RX_BUFFERMASK)
+		if (rxBuf[i] == UART_LINE_DELIMITER)
+			n++;
+
+	return n;
+}
+
+static int
+check(const char *what, int ok)
+{
+	if (!ok)
+		printf("  byte %lu: %s\n", n_received, what);
+	return !ok;
+}
+
+int
+main()
+{
+	uint8_t buf[LINE_MAX + 2], n, size, lines, full;
+	unsigned long getc_n = 0, read_n = 0, line_n = 0, parts = 0;
+	unsigned long i, delimiters = 0;
+	int errors = 0;
+
+	srand(1);
+	make_lines();
+	uart_init();
+	uart_set_line_callback(line_callback);
+
+	while (n_received < BYTES && errors < 10) {
+		/* a burst of bytes, as much as fits (without flow control
+		 * bytes that don't fit are dropped, the test avoids that) */
+		for (n = rand() % 8; n && n_sent < BYTES &&
+				ringbuf_free(&rxRing, RX_BUFFERMASK) != 0; n--)
+			receive();
+
+		errors += check("line count",
+				uart_lines_available() == lines_buffered());
+
+		lines = lines_buffered();
+		full = ringbuf_free(&rxRing, RX_BUFFERMASK) == 0;
+
+		switch (rand() % 3) {
+			case 0:
+				if (uart_getc((char *)buf) == 0) {
+					received[n_received++] = buf[0];
+					getc_n++;
+				}
+				break;
+
+			case 1:
+				n = uart_read(buf, 1 + rand() % LINE_MAX);
+				memcpy(&received[n_received], buf, n);
+				n_received += n;
+				read_n += n != 0;
+				break;
+
+			case 2:
+				size = 1 + rand() % (LINE_MAX + 1);
+				n = uart_read_line((char *)buf, size);
+				errors += check("read_line without a line",
+						n == 0 || lines || full);
+				errors += check("no line from read_line",
+						n != 0 || (!lines && !full));
+				if (n && buf[n - 1] != UART_LINE_DELIMITER) {
+					/* a part of a long line */
+					errors += check("short part",
+							n == size || (!lines && full));
+					parts++;
+				}
+				if (n && memchr(buf, UART_LINE_DELIMITER, n - 1))
+					errors += check("two lines at once", 0);
+				memcpy(&received[n_received], buf, n);
+				n_received += n;
+				line_n += n != 0;
+				break;
+		}
+
+		errors += check("line count after reading",
+				uart_lines_available() == lines_buffered());
+	}
+
+	errors += check("bytes differ",
+			memcmp(sent, received, n_received) == 0);
+	for (i = 0; i < n_sent; i++)
+		delimiters += sent[i] == UART_LINE_DELIMITER;
+	errors += check("callbacks", callbacks == delimiters);
+
+	printf("uart lines, %lu bytes: %lu getc, %lu read, %lu read_line "
+			"(%lu parts of long lines), %lu callbacks: %s\n",
+			n_received, getc_n, read_n, line_n, parts, callbacks,
+			errors ? "FAILED" : "ok");
+
+	return errors != 0;
+}
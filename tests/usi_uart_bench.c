@@ -0,0 +1,862 @@
+/*
+ * Host bench of the usi uart (ATtiny85). The driver runs against the
+ * stub registers, this file plays the hardware around it cycle by
+ * cycle:
+ *
+ * - timer0 in normal and CTC mode, timer1 in CTC mode (OCR1C) from the
+ *   system clock or the 64MHz pll, with their prescalers
+ * - the usi in three wire mode: shift register and 4 bit counter,
+ *   clocked by the USICLK strobe or the timer0 compare match
+ * - the pin change interrupt of PB0 (DI)
+ * - the interrupts by priority, each with the cycles until its first
+ *   register access and the cycles until reti, see isr_cycles[]
+ * - the other side: a usart at BAUDRATE plus a skew that sends to PB0
+ *   and receives from PB1 (DO)
+ *
+ * The main program takes no time, only waiting (sleep, delays) does.
+ * The interrupt cycles are estimates of the code avr-gcc generates,
+ * -l adds to all of them to see how much the timing can take.
+ *
+ * For every skew of the other side:
+ * rx    bytes sent back to back, as read by the main program
+ * tx    bytes sent by the driver as decoded by the other side, the bit
+ *       rate and the largest edge deviation from it, the throughput
+ * echo  request/response: time from the end of a request to the start
+ *       bit of the response (turnaround), the next request follows the
+ *       response after -r bits and must be received too
+ *
+ * reverse_byte() of the REVERSE_TABLE setting is checked for all 256
+ * values first. The cycles it takes are estimated like in printf_count.c:
+ * the flash reads are counted by the pgm_read_byte() stub, the rest of
+ * the instructions is CYC_REVERSE. The throughput of the rx and tx tests
+ * does not depend on it, the main program takes no time here.
+ *
+ * With RX_CALLBACK the rx test runs once more with a callback for every
+ * byte that takes CALLBACK_CYCLES.
+ *
+ * Returns non-zero if a byte was lost or wrong.
+ */
+#include <math.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "../usi_uart/usi_uart.c"
+
+#if TIMER1 && TIMER1_PLL
+ #define MODE "timer1 pll"
+#elif TIMER1
+ #define MODE "timer1"
+#elif TIMER0_CTC
+ #define MODE "timer0 ctc"
+#else
+ #define MODE "timer0 overflow"
+#endif
+
+#define MAX_BYTES 1000
+#define ECHOS 32
+
+/* interrupt vectors of the tiny85, the number is the priority */
+#define VECTORS			15
+#define VECT_PCINT0		2
+#define VECT_TIM1_COMPA	3
+#define VECT_TIM1_OVF	4
+#define VECT_TIM0_OVF	5
+#define VECT_TIM0_COMPA	10
+#define VECT_USI_OVF	14
+
+static void (*const vectors[VECTORS])(void) = {
+	[VECT_PCINT0] = PCINT0_vect,
+#if TIMER1
+	[VECT_TIM1_COMPA] = TIM1_COMPA_vect,
+#if CALIBRATION
+	[VECT_TIM1_OVF] = TIM1_OVF_vect,
+#endif
+#elif TIMER0_CTC
+	[VECT_TIM0_COMPA] = TIM0_COMPA_vect,
+#if CALIBRATION
+	[VECT_TIM0_OVF] = TIM0_OVF_vect,
+#endif
+#else
+	[VECT_TIM0_OVF] = TIM0_OVF_vect,
+#endif
+	[VECT_USI_OVF] = USI_OVF_vect,
+};
+
+/* cycles from the flag to the first register access (response, vector
+ * jump, prologue) and from there to the end of reti */
+static const struct {
+	unsigned latency, duration;
+} isr_cycles[VECTORS] = {
+	[VECT_PCINT0]		= { 16, 40 },
+	[VECT_TIM1_COMPA]	= { 14, 26 },
+	[VECT_TIM1_OVF]		= { 14, 14 },
+	[VECT_TIM0_OVF]		= { 16, 30 },
+	[VECT_TIM0_COMPA]	= { 18, 40 },
+	[VECT_USI_OVF]		= { 20, 50 },
+};
+
+/* cycles of reverse_byte() besides the flash reads (lpm, 3 cycles each),
+ * estimated from the instructions avr-gcc generates for it */
+#if REVERSE_TABLE == 2
+ #define CYC_REVERSE 4		/* table address in Z: ldi, ldi, add, adc */
+#elif REVERSE_TABLE == 1
+ #define CYC_REVERSE 14		/* two table addresses, andi, swap, or */
+#else
+ #define CYC_REVERSE 15		/* three mov, shift, andi, shift, andi, or; swap */
+#endif
+#define CYC_LPM 3
+
+/* internal oscillator: clock change per OSCCAL step */
+#define OSCCAL_STEP 0.006
+#define OSCCAL_INITIAL 0x50
+
+/* timer1 ticks per system clock cycle from the pll */
+#define PLL_RATIO (64000000UL/(F_CPU))
+
+static struct {
+	double now;				/* seconds */
+	double f_cpu;			/* system clock, depends on OSCCAL */
+	double drift;			/* clock error at OSCCAL_INITIAL */
+	uint8_t osccal;			/* OSCCAL f_cpu was calculated for */
+	unsigned long interrupts;
+	unsigned extra_latency;
+	double deadline;		/* a test gives up here */
+	void (*delay_hook)(void);	/* runs once in the next delay */
+	jmp_buf timeout;
+
+	/* the real flags, in the registers they read as 0 */
+	uint8_t tov0, ocf0a, tov1, ocf1a, pcif, usioif;
+	unsigned prescaler0, prescaler1;
+	uint8_t di;				/* level of PB0 */
+} sim;
+
+/* the other side */
+static struct {
+	double bit;				/* bit time */
+
+	/* transmitter, drives PB0 */
+	const uint8_t *tx;
+	unsigned tx_n, tx_i;
+	double tx_start;		/* start bit of tx[tx_i] */
+	unsigned tx_gap;		/* idle bits after every frame */
+
+	/* receiver, watches PB1 */
+	uint8_t rx[MAX_BYTES];
+	unsigned rx_n, rx_frame_errors;
+	int rx_bit;				/* next bit to sample, -1: waiting for a start bit */
+	uint8_t rx_byte, line;
+	double rx_start, rx_sample;	/* start bit edge, next sample */
+	double rx_first, rx_end;	/* first start bit, end of the last stop bit */
+
+	/* edges inside the frames: bit number and time after the start bit */
+	unsigned edges;
+	uint8_t edge_bit[MAX_BYTES * 9];
+	double edge_time[MAX_BYTES * 9];
+} peer;
+
+static unsigned seed = 1;
+
+static uint8_t
+random_byte(void)
+{
+	seed = seed * 1103515245 + 12345;
+	return seed >> 16;
+}
+
+/*
+ * hardware
+ */
+
+/* one usi clock: shift DI in, count, overflow at 16 */
+static void
+usi_clock(void)
+{
+	uint8_t count = (USISR + 1) & 0x0f;
+
+	USIDR = (USIDR << 1) | sim.di;
+	USISR = (USISR & 0xf0) | count;
+	if (count == 0)
+		sim.usioif = 1;
+}
+
+static void
+timer0_tick(void)
+{
+	uint8_t match = 0;
+
+	if ((TCCR0A & (1<<WGM01)) && TCNT0 == OCR0A) {
+		/* CTC: the flag is set when the counter is cleared */
+		TCNT0 = 0;
+		match = 1;
+	} else {
+		if (++TCNT0 == 0)
+			sim.tov0 = 1;
+		match = !(TCCR0A & (1<<WGM01)) && TCNT0 == OCR0A;
+	}
+
+	if (match) {
+		sim.ocf0a = 1;
+		if ((USICR & ((1<<USICS1) | (1<<USICS0))) == (1<<USICS0))
+			usi_clock();
+	}
+}
+
+static void
+timer1_tick(void)
+{
+	if ((TCCR1 & (1<<CTC1)) && TCNT1 == OCR1C)
+		TCNT1 = 0;
+	else if (++TCNT1 == 0)
+		sim.tov1 = 1;
+
+	if (TCNT1 == OCR1A)
+		sim.ocf1a = 1;
+}
+
+/* level of PB1 as seen by the other side */
+static uint8_t
+do_level(void)
+{
+	if (!(DDRB & (1<<PB1)))
+		return 1;		/* input with pull-up, idle line */
+	if (USICR & ((1<<USIWM1) | (1<<USIWM0)))
+		return USIDR >> 7;
+	return (PORTB >> PB1) & 1;
+}
+
+/* level the transmitter of the other side puts on PB0 */
+static uint8_t
+peer_tx_level(void)
+{
+	unsigned k;
+	double t;
+
+	while (peer.tx_i < peer.tx_n) {
+		t = (sim.now - peer.tx_start) / peer.bit;
+		if (t < 0)
+			return 1;
+		k = t;
+		if (k < 10 + peer.tx_gap)
+			return k == 0 ? 0 : k <= 8 ? (peer.tx[peer.tx_i] >> (k - 1)) & 1 : 1;
+		peer.tx_i++;
+		peer.tx_start += (10 + peer.tx_gap) * peer.bit;
+	}
+
+	return 1;
+}
+
+/* the receiver of the other side samples in the middle of its bits */
+static void
+peer_receive(void)
+{
+	uint8_t level = do_level();
+	double t;
+
+	if (peer.rx_bit < 0) {
+		if (level == 0 && peer.line == 1) {
+			peer.rx_bit = 0;
+			peer.rx_start = sim.now;
+			peer.rx_sample = sim.now + peer.bit/2;
+			if (peer.rx_n == 0)
+				peer.rx_first = sim.now;
+		}
+		peer.line = level;
+		return;
+	}
+
+	if (level != peer.line && peer.edges < MAX_BYTES * 9) {
+		t = sim.now - peer.rx_start;
+		peer.edge_bit[peer.edges] = lround(t / peer.bit);
+		peer.edge_time[peer.edges++] = t;
+	}
+	peer.line = level;
+
+	if (sim.now < peer.rx_sample)
+		return;
+	peer.rx_sample += peer.bit;
+
+	if (peer.rx_bit == 0) {
+		/* glitch, no start bit */
+		if (level)
+			peer.rx_bit = -1;
+		else
+			peer.rx_bit++;
+	} else if (peer.rx_bit <= 8) {
+		peer.rx_byte = (peer.rx_byte >> 1) | (level << 7);
+		peer.rx_bit++;
+	} else {
+		if (!level)
+			peer.rx_frame_errors++;
+		if (peer.rx_n < MAX_BYTES)
+			peer.rx[peer.rx_n++] = peer.rx_byte;
+		peer.rx_end = peer.rx_start + 10 * peer.bit;
+		peer.rx_bit = -1;
+	}
+}
+
+/* one cycle of the system clock */
+static void
+step(void)
+{
+	static const unsigned timer0_div[8] = { 0, 1, 8, 64, 256, 1024, 0, 0 };
+	uint8_t level, cs, i, n;
+
+	if (OSCCAL != sim.osccal) {
+		sim.osccal = OSCCAL;
+		sim.f_cpu = (F_CPU) * (1 + sim.drift +
+				OSCCAL_STEP * ((int)OSCCAL - OSCCAL_INITIAL));
+	}
+	sim.now += 1 / sim.f_cpu;
+
+	/* pin change on DI */
+	level = peer_tx_level();
+	if (level != sim.di) {
+		sim.di = level;
+		PINB = (PINB & ~(1<<PB0)) | level;
+		if (PCMSK & (1<<PCINT0))
+			sim.pcif = 1;
+	}
+
+	sim.prescaler0++;
+	cs = TCCR0B & 0x07;
+	if (timer0_div[cs] && sim.prescaler0 % timer0_div[cs] == 0)
+		timer0_tick();
+
+	cs = TCCR1 & 0x0f;
+	if (cs) {
+		n = (PLLCSR & (1<<PCKE)) ? PLL_RATIO : 1;
+		for (i = 0; i < n; i++)
+			if (++sim.prescaler1 % (1U << (cs - 1)) == 0)
+				timer1_tick();
+	}
+
+	peer_receive();
+}
+
+/* takes the ones the driver wrote to the flags, the usi strobe */
+static void
+sync_flags(void)
+{
+	if (TIFR & (1<<TOV0))
+		sim.tov0 = 0;
+	if (TIFR & (1<<OCF0A))
+		sim.ocf0a = 0;
+	if (TIFR & (1<<TOV1))
+		sim.tov1 = 0;
+	if (TIFR & (1<<OCF1A))
+		sim.ocf1a = 0;
+	TIFR = 0;
+
+	if (GIFR & (1<<PCIF))
+		sim.pcif = 0;
+	GIFR = 0;
+
+	if (USISR & (1<<USIOIF))
+		sim.usioif = 0;
+	USISR &= 0x0f;
+
+	if (USICR & (1<<USICLK)) {
+		USICR &= ~(1<<USICLK);
+		if (!(USICR & ((1<<USICS1) | (1<<USICS0))))
+			usi_clock();
+	}
+
+	/* locks at once */
+	if (PLLCSR & (1<<PLLE))
+		PLLCSR |= (1<<PLOCK);
+}
+
+/* highest priority interrupt that is pending and enabled, 0 if none */
+static int
+pending(void)
+{
+	if (sim.pcif && (GIMSK & (1<<PCIE)))
+		return VECT_PCINT0;
+	if (sim.ocf1a && (TIMSK & (1<<OCIE1A)))
+		return VECT_TIM1_COMPA;
+	if (sim.tov1 && (TIMSK & (1<<TOIE1)))
+		return VECT_TIM1_OVF;
+	if (sim.tov0 && (TIMSK & (1<<TOIE0)))
+		return VECT_TIM0_OVF;
+	if (sim.ocf0a && (TIMSK & (1<<OCIE0A)))
+		return VECT_TIM0_COMPA;
+	if (sim.usioif && (USICR & (1<<USIOIE)))
+		return VECT_USI_OVF;
+	return 0;
+}
+
+static void tick(void);
+
+/* runs interrupt 'v'. the routine may enable interrupts again
+ * (initialize_receiver() does), the rest of it can be interrupted then */
+static void
+interrupt(int v)
+{
+	unsigned n;
+
+	if (!vectors[v]) {
+		fprintf(stderr, "interrupt %d has no routine\n", v);
+		exit(2);
+	}
+
+	switch (v) {
+		case VECT_PCINT0: sim.pcif = 0; break;
+		case VECT_TIM1_COMPA: sim.ocf1a = 0; break;
+		case VECT_TIM1_OVF: sim.tov1 = 0; break;
+		case VECT_TIM0_OVF: sim.tov0 = 0; break;
+		case VECT_TIM0_COMPA: sim.ocf0a = 0; break;
+	}
+
+	SREG &= ~(1<<SREG_I);
+	for (n = isr_cycles[v].latency + sim.extra_latency; n; n--)
+		step();
+
+	vectors[v]();
+	sync_flags();
+
+	for (n = isr_cycles[v].duration; n; n--)
+		tick();
+
+	SREG |= (1<<SREG_I);
+	sim.interrupts++;
+}
+
+/* one cycle, or an interrupt */
+static void
+tick(void)
+{
+	int v;
+
+	if ((SREG & (1<<SREG_I)) && (v = pending()) != 0)
+		interrupt(v);
+	else
+		step();
+
+	if (sim.now > sim.deadline)
+		longjmp(sim.timeout, 1);
+}
+
+/* sleep_cpu(): returns after an interrupt */
+void
+sim_sleep(void)
+{
+	unsigned long n = sim.interrupts;
+
+	sync_flags();
+	while (sim.interrupts == n)
+		tick();
+}
+
+/* _delay_us(), _delay_ms() */
+void
+sim_delay(double seconds)
+{
+	double end = sim.now + seconds;
+	void (*hook)(void) = sim.delay_hook;
+
+	if (hook) {
+		sim.delay_hook = NULL;
+		hook();
+	}
+	sync_flags();
+	while (sim.now < end)
+		tick();
+}
+
+/*
+ * tests
+ */
+
+static void
+device_reset(double skew)
+{
+	PORTB = DDRB = 0;
+	PINB = (1<<PB0);
+	USIDR = USISR = USICR = 0;
+	GIMSK = GIFR = PCMSK = 0;
+	TIMSK = TIFR = 0;
+	TCCR0A = TCCR0B = TCNT0 = OCR0A = OCR0B = 0;
+	TCCR1 = TCNT1 = OCR1A = OCR1B = OCR1C = 0;
+	PLLCSR = 0;
+	OSCCAL = OSCCAL_INITIAL;
+	SREG = 0;
+
+	sim.now = 0;
+	sim.drift = 0;
+	sim.osccal = ~OSCCAL;
+	sim.tov0 = sim.ocf0a = sim.tov1 = sim.ocf1a = sim.pcif = sim.usioif = 0;
+	sim.di = 1;
+
+	memset(&peer, 0, sizeof(peer));
+	peer.bit = 1.0 / (BAUDRATE * (1 + skew / 100));
+	peer.rx_bit = -1;
+	peer.line = 1;
+
+	/* the driver's state */
+	ringbuf_init(&rx_ring);
+	ringbuf_init(&tx_ring);
+	state = STATE_IDLE;
+#if USI_UART_STATS
+	usi_uart_reset_stats();
+#endif
+
+	sim.deadline = 1;
+	usi_uart_init();
+}
+
+/* the other side sends 'n' bytes from 'data', the first one at 'at' */
+static void
+peer_send(const uint8_t *data, unsigned n, unsigned gap, double at)
+{
+	peer.tx = data;
+	peer.tx_n = n;
+	peer.tx_i = 0;
+	peer.tx_gap = gap;
+	peer.tx_start = at;
+}
+
+static struct {
+	unsigned n, ok;
+	double end;
+	double min, max;
+} res;
+
+/* the other side sends 'n' bytes back to back */
+static int
+test_rx(unsigned n, unsigned gap)
+{
+	static uint8_t data[MAX_BYTES];
+	double start = sim.now;
+	char c;
+	unsigned i;
+
+	for (i = 0; i < n; i++)
+		data[i] = random_byte();
+	peer_send(data, n, gap, start + peer.bit);
+	sim.deadline = start + (n + 2) * (10 + gap) * peer.bit + 0.01;
+
+	res.n = res.ok = 0;
+	if (setjmp(sim.timeout) == 0) {
+		while (res.n < n) {
+			if (usi_uart_recvc(&c) == 0) {
+				if ((uint8_t)c == data[res.n])
+					res.ok++;
+				res.n++;
+				res.end = sim.now;
+			} else {
+				sim_sleep();
+			}
+		}
+	}
+
+	printf("  rx   %u/%u ok", res.ok, n);
+#if USI_UART_STATS
+	printf(", %u frame errors, %u overruns", stats.frame_errors, stats.overruns);
+#endif
+	if (res.n)
+		printf(", %.0f bytes/s", res.n / (res.end - start));
+	printf("\n");
+
+	return res.ok != n;
+}
+
+/* the driver sends 'n' bytes */
+static int
+test_tx(unsigned n)
+{
+	static uint8_t data[MAX_BYTES];
+	double kt = 0, kk = 0, slope, jitter = 0, d;
+	unsigned i;
+
+	for (i = 0; i < n; i++)
+		data[i] = random_byte();
+	sim.deadline = sim.now + (n + 2) * 12 * peer.bit + 0.01;
+
+	if (setjmp(sim.timeout) == 0) {
+		for (i = 0; i < n; i++)
+			usi_uart_sendc(data[i]);
+		usi_uart_flush();
+		/* the other side samples the last stop bit */
+		sim_delay(peer.bit);
+	}
+
+	res.ok = 0;
+	for (i = 0; i < peer.rx_n && i < n; i++)
+		if (peer.rx[i] == data[i])
+			res.ok++;
+
+	printf("  tx   %u/%u ok, %u frame errors", res.ok, n, peer.rx_frame_errors);
+
+	/* bit time through the origin (start bit) of every frame, the
+	 * largest deviation of an edge from it */
+	for (i = 0; i < peer.edges; i++) {
+		kt += peer.edge_bit[i] * peer.edge_time[i];
+		kk += peer.edge_bit[i] * peer.edge_bit[i];
+	}
+	if (kk > 0) {
+		slope = kt / kk;
+		for (i = 0; i < peer.edges; i++) {
+			d = fabs(peer.edge_time[i] - peer.edge_bit[i] * slope) / slope;
+			if (d > jitter)
+				jitter = d;
+		}
+		printf(", %.0f baud (%+.2f%%), edges within %.1f%% of a bit",
+				1 / slope, 100 * (1 / slope / BAUDRATE - 1), 100 * jitter);
+	}
+	if (peer.rx_n)
+		printf(", %.0f bytes/s (%.0f%%)", peer.rx_n / (peer.rx_end - peer.rx_first),
+				100 * peer.rx_n / (peer.rx_end - peer.rx_first) / (BAUDRATE / 10.0));
+	printf("\n");
+
+	return res.ok != n;
+}
+
+/* request and response, the next request 'reply_gap' bits after the
+ * response */
+static int
+test_echo(unsigned reply_gap)
+{
+	static uint8_t data[ECHOS];
+	double request_end, turnaround;
+	char c;
+
+	res.n = res.ok = 0;
+	res.min = 1;
+	res.max = 0;
+
+	if (setjmp(sim.timeout) == 0) {
+		request_end = sim.now;
+		while (res.n < ECHOS) {
+			data[res.n] = random_byte();
+			peer_send(&data[res.n], 1, 0, request_end + reply_gap * peer.bit);
+			request_end = peer.tx_start + 10 * peer.bit;
+			sim.deadline = request_end + 0.01;
+
+			/* the main program echoes the byte */
+			while (usi_uart_recvc(&c) != 0)
+				sim_sleep();
+			usi_uart_sendc(c);
+
+			while (peer.rx_n == res.n)
+				sim_delay(peer.bit / 4);
+
+			turnaround = peer.rx_start - request_end;
+			if (turnaround < res.min)
+				res.min = turnaround;
+			if (turnaround > res.max)
+				res.max = turnaround;
+			if (peer.rx[res.n] == data[res.n])
+				res.ok++;
+			res.n++;
+			request_end = peer.rx_end;
+		}
+	}
+
+	printf("  echo %u/%u ok", res.ok, ECHOS);
+	if (res.n)
+		printf(", turnaround %.0f-%.0fus (%.1f-%.1f bits)", res.min * 1e6,
+				res.max * 1e6, res.min / peer.bit, res.max / peer.bit);
+	if (res.n < ECHOS)
+		printf(", request %u lost (%u bits after the response)", res.n + 1, reply_gap);
+	printf("\n");
+
+	return res.ok != ECHOS;
+}
+
+/* reverse_byte() against a bit by bit reversal, and what it costs */
+static int
+test_reverse(void)
+{
+	unsigned b, i, errors = 0;
+	uint8_t r;
+	double lpm, cycles;
+
+	stub_lpm = 0;
+	for (b = 0; b < 256; b++) {
+		for (r = 0, i = 0; i < 8; i++)
+			if (b & (1<<i))
+				r |= 0x80 >> i;
+		errors += reverse_byte(b) != r;
+	}
+	lpm = stub_lpm / 256.0;
+	cycles = CYC_REVERSE + CYC_LPM * lpm;
+
+	/* once per byte sent or received, a byte takes ten bit times */
+	printf("bit reversal (REVERSE_TABLE %d): %.0f flash reads, ~%.0f cycles "
+			"per byte, %.2f%% of a byte time: %s\n", REVERSE_TABLE, lpm,
+			cycles, 100 * cycles * BAUDRATE / (10.0 * (F_CPU)),
+			errors ? "FAILED" : "ok");
+
+	return errors != 0;
+}
+
+#if RX_CALLBACK
+/* about a bit time at 19200 baud and 8MHz */
+#define CALLBACK_CYCLES 400
+
+static unsigned callback_n;
+
+/* runs in the receive interrupt, interrupts are handled meanwhile if
+ * they are enabled */
+static void
+slow_callback(char c)
+{
+	unsigned n;
+
+	callback_n++;
+	for (n = CALLBACK_CYCLES; n; n--)
+		tick();
+}
+
+/* the rx test, a callback for every byte delays the receive interrupt */
+static int
+test_rx_callback(unsigned n, unsigned gap)
+{
+	int errors;
+
+	callback_n = 0;
+	usi_uart_set_rx_callback(slow_callback);
+	errors = test_rx(n, gap);
+	usi_uart_set_rx_callback(NULL);
+
+	printf("  rx callback called %u times\n", callback_n);
+
+	return errors || callback_n != n;
+}
+#endif
+
+#if CALIBRATION
+static uint8_t sync_bytes[4000];
+
+/* the other side sends sync bytes with 'gap' idle bits in between, the
+ * internal oscillator is 'drift' percent off */
+static int
+test_calibration(double drift, unsigned gap)
+{
+	double error;
+	int ret = 2;
+
+	device_reset(0);
+	sim.drift = drift / 100;
+	sim.osccal = ~OSCCAL;
+	peer_send(sync_bytes, sizeof(sync_bytes), gap, sim.now + peer.bit);
+	sim.deadline = sim.now + 40;
+
+	if (setjmp(sim.timeout) == 0)
+		ret = usi_uart_calibrate();
+
+	error = (1 + sim.drift + OSCCAL_STEP * ((int)OSCCAL - OSCCAL_INITIAL)) - 1;
+	printf("  calibration, clock %+.1f%%, %u idle bits: %s, clock %+.2f%% off "
+			"after %d OSCCAL steps\n", drift, gap,
+			ret == 0 ? "ok" : ret == 1 ? "failed" : "timeout", 100 * error,
+			(int)OSCCAL - OSCCAL_INITIAL);
+
+	return ret != 0 || fabs(error) > 0.01;
+}
+
+static void
+send_x(void)
+{
+	usi_uart_sendc('x');
+}
+
+/* an interrupt of the application sends a byte while calibrating. the
+ * sync bytes stop early, the calibration gives up on the line idle */
+static int
+test_calibration_send(void)
+{
+	device_reset(0);
+	sim.drift = 0.05;
+	sim.osccal = ~OSCCAL;
+	peer_send(sync_bytes, 20, 0, sim.now + peer.bit);
+	sim.deadline = sim.now + 40;
+	sim.delay_hook = send_x;
+
+	if (setjmp(sim.timeout) == 0) {
+		usi_uart_calibrate();
+		sim_delay(30 * peer.bit);
+	}
+
+	res.ok = peer.rx_n == 1 && peer.rx[0] == 'x';
+	printf("  byte sent while calibrating: %s\n",
+			res.ok ? "sent afterwards" : "not sent");
+
+	return !res.ok;
+}
+#endif
+
+static void
+usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-n bytes] [-s skew%%] [-g gap] [-r gap] [-l cycles]\n"
+			"  -n  bytes of the rx and tx tests (max %d)\n"
+			"  -s  baudrate error of the other side in %%, default -2 to 2\n"
+			"  -g  idle bits between the bytes of the other side\n"
+			"  -r  idle bits between response and next request\n"
+			"  -l  cycles added to the latency of all interrupts\n",
+			name, MAX_BYTES);
+	exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+	static const double skews[] = { -2, -1, 0, 1, 2 };
+	const double *skew = skews;
+	unsigned n = 200, gap = 0, reply_gap = 0, i, count = 5;
+	double one_skew;
+	int opt, errors = 0;
+
+	while ((opt = getopt(argc, argv, "n:s:g:r:l:")) != -1) {
+		switch (opt) {
+			case 'n': n = atoi(optarg); break;
+			case 's': one_skew = atof(optarg); skew = &one_skew; count = 1; break;
+			case 'g': gap = atoi(optarg); break;
+			case 'r': reply_gap = atoi(optarg); break;
+			case 'l': sim.extra_latency = atoi(optarg); break;
+			default: usage(argv[0]);
+		}
+	}
+	if (n == 0 || n > MAX_BYTES)
+		usage(argv[0]);
+
+	printf("usi_uart %u baud, %s, prescaler %u, F_CPU %lu, +%u cycles latency\n",
+			BAUDRATE, MODE, TIMER_PRESCALER, (unsigned long)(F_CPU),
+			sim.extra_latency);
+	errors += test_reverse();
+
+	for (i = 0; i < count; i++) {
+		printf("skew %+.1f%%\n", skew[i]);
+
+		device_reset(skew[i]);
+		errors += test_rx(n, gap);
+		device_reset(skew[i]);
+		errors += test_tx(n);
+		device_reset(skew[i]);
+		errors += test_echo(reply_gap);
+	}
+
+#if RX_CALLBACK
+	printf("rx callback, %u cycles\n", CALLBACK_CYCLES);
+	device_reset(0);
+	errors += test_rx_callback(n, gap);
+#endif
+
+#if CALIBRATION
+	memset(sync_bytes, 0x55, sizeof(sync_bytes));
+	printf("calibration\n");
+	errors += test_calibration(5, 0);
+	errors += test_calibration(-5, 0);
+	/* the gap between the sync bytes is 7 bits */
+	errors += test_calibration(5, 5);
+	errors += test_calibration(-5, 5);
+	/* gaps the 8-bit timer would alias into the window */
+	errors += test_calibration(5, 9);
+	errors += test_calibration(5, 23);
+	errors += test_calibration_send();
+#endif
+
+	return errors != 0;
+}
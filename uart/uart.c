@@ -1,96 +1,459 @@
+/*
+ * The driver is compiled once per usart: UART_INSTANCE selects the
+ * registers, vectors, buffer sizes and function prefix at compile time
+ * (uart_* for instance 0, uart1_* for instance 1, see uart1.c).
+ */
 #include "uart.h"
+#include "../common/ringbuf.h"
+#include "../common/sleep_wait.h"
 
+#include <string.h>
+#include <stdarg.h>
+#include <avr/io.h>
 #include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <util/atomic.h>
+#include <util/delay.h>
+
+#ifndef UART_INSTANCE
+#define UART_INSTANCE 0
+#endif
+
+#if UART_INSTANCE == 0
+    #define UART_FN(name) uart_##name
+    #define UART_RX_VECT RX_COMPL_INT
+    #define UART_UDRE_VECT TX_REG_EMPTY_INT
+    #define UART_TXC_VECT TX_COMPL_INT
+    #define UART_RX_SIZE RX_BUFFERSIZE
+    #define UART_TX_SIZE TX_BUFFERSIZE
+
+    #if UART_FLOW_CONTROL
+    #define FLOW_CONTROL 1
+    #define RTS_PORT UART_RTS_PORT
+    #define RTS_DDR UART_RTS_DDR
+    #define RTS_PIN UART_RTS_PIN
+    #define RTS_HIGH_WATER UART_RTS_HIGH_WATER
+    #define RTS_LOW_WATER UART_RTS_LOW_WATER
+    #define CTS_PINREG UART_CTS_PINREG
+    #define CTS_DDR UART_CTS_DDR
+    #define CTS_PIN UART_CTS_PIN
+    #define CTS_VECT UART_CTS_vect
+    #define CTS_INT_ENABLE() UART_CTS_INT_ENABLE()
+    #endif
+
+    #define MPCM_MODE UART_MPCM
+    #define MPCM_ADDRESS UART_MPCM_ADDRESS
+
+    #if UART_RS485
+    #define RS485 1
+    #define RS485_NO_ECHO UART_RS485_NO_ECHO
+    #define DE_PORT UART_RS485_DE_PORT
+    #define DE_DDR UART_RS485_DE_DDR
+    #define DE_PIN UART_RS485_DE_PIN
+    #endif
+
+    #ifdef UDR0
+    #define UART_UDR UDR0
+    #define UART_UCSRA UCSR0A
+    #define UART_UCSRB UCSR0B
+    #define UART_UCSRC UCSR0C
+    #define UART_UBRRH UBRR0H
+    #define UART_UBRRL UBRR0L
+    #else
+    #define UART_UDR UDR
+    #define UART_UCSRA UCSRA
+    #define UART_UCSRB UCSRB
+    #define UART_UCSRC UCSRC
+    #define UART_UBRRH UBRRH
+    #define UART_UBRRL UBRRL
+    #endif
+
+#elif UART_INSTANCE == 1
+    #if !UART1_AVAILABLE
+    #error "this device has no second usart"
+    #endif
+
+    #define UART_FN(name) uart1_##name
+    #define UART_RX_VECT UART1_RX_COMPL_INT
+    #define UART_UDRE_VECT UART1_TX_REG_EMPTY_INT
+    #define UART_TXC_VECT UART1_TX_COMPL_INT
+    #define UART_RX_SIZE UART1_RX_BUFFERSIZE
+    #define UART_TX_SIZE UART1_TX_BUFFERSIZE
+
+    #if UART1_FLOW_CONTROL
+    #define FLOW_CONTROL 1
+    #define RTS_PORT UART1_RTS_PORT
+    #define RTS_DDR UART1_RTS_DDR
+    #define RTS_PIN UART1_RTS_PIN
+    #define RTS_HIGH_WATER UART1_RTS_HIGH_WATER
+    #define RTS_LOW_WATER UART1_RTS_LOW_WATER
+    #define CTS_PINREG UART1_CTS_PINREG
+    #define CTS_DDR UART1_CTS_DDR
+    #define CTS_PIN UART1_CTS_PIN
+    #define CTS_VECT UART1_CTS_vect
+    #define CTS_INT_ENABLE() UART1_CTS_INT_ENABLE()
+    #endif
+
+    #define MPCM_MODE UART1_MPCM
+    #define MPCM_ADDRESS UART1_MPCM_ADDRESS
+
+    #if UART1_RS485
+    #define RS485 1
+    #define RS485_NO_ECHO UART1_RS485_NO_ECHO
+    #define DE_PORT UART1_RS485_DE_PORT
+    #define DE_DDR UART1_RS485_DE_DDR
+    #define DE_PIN UART1_RS485_DE_PIN
+    #endif
+
+    #define UART_UDR UDR1
+    #define UART_UCSRA UCSR1A
+    #define UART_UCSRB UCSR1B
+    #define UART_UCSRC UCSR1C
+    #define UART_UBRRH UBRR1H
+    #define UART_UBRRL UBRR1L
+
+    #undef BAUD
+    #define BAUD UART1_BAUD_RATE
+
+#else
+    #error "unsupported UART_INSTANCE"
+#endif
+
 #include <util/setbaud.h>
 
+/* the bit positions are the same on all devices, only some of them
+ * have the usart number in their names */
+#ifndef RXCIE
+#define RXC RXC0
+#define TXC TXC0
+#define UDRE UDRE0
+#define FE FE0
+#define DOR DOR0
+#define UPE UPE0
+#define U2X U2X0
+#define MPCM MPCM0
+#define RXCIE RXCIE0
+#define TXCIE TXCIE0
+#define UDRIE UDRIE0
+#define RXEN RXEN0
+#define TXEN TXEN0
+#define UCSZ2 UCSZ02
+#define RXB8 RXB80
+#define TXB8 TXB80
+#define UCSZ1 UCSZ01
+#define UCSZ0 UCSZ00
+#endif
+
+
+#define RX_BUFFERMASK (UART_RX_SIZE-1)
+#define TX_BUFFERMASK (UART_TX_SIZE-1)
+
+RINGBUF_CHECK_SIZE(rx_buffer, UART_RX_SIZE);
+RINGBUF_CHECK_SIZE(tx_buffer, UART_TX_SIZE);
+
+static ringbuf_t rxRing, txRing;
+static uint8_t rxBuf[UART_RX_SIZE], txBuf[UART_TX_SIZE];
+
+/* parity error flag is called PE on some devices */
+#ifndef UPE
+#define UPE PE
+#endif
+
+#if UART_STATS
+static uart_stats_t stats;
+
+#define STATS_INC(field) stats.field++
+#define STATS_LEVEL(field, level) \
+    do { uint8_t l_ = (level); if(l_ > stats.field) stats.field = l_; } while(0)
+#else
+#define STATS_INC(field)
+#define STATS_LEVEL(field, level)
+#endif
+
+#if FLOW_CONTROL
+#if RTS_HIGH_WATER >= UART_RX_SIZE || RTS_LOW_WATER >= RTS_HIGH_WATER
+#error "invalid rts water marks"
+#endif
+
+/* rts is active low: asserted while we are able to receive */
+#define RTS_ASSERT() RTS_PORT &= ~(1<<RTS_PIN)
+#define RTS_DEASSERT() RTS_PORT |= (1<<RTS_PIN)
+#define RTS_DEASSERTED() (RTS_PORT & (1<<RTS_PIN))
+#define CTS_ASSERTED() (!(CTS_PINREG & (1<<CTS_PIN)))
+#else
+#define CTS_ASSERTED() 1
+#endif
+
+/* blocking functions wait for space/data in the buffers like this */
+#if UART_SLEEP_WHILE_BLOCKED
+#define WAIT_WHILE(cond) SLEEP_WAIT_WHILE(cond)
+#else
+#define WAIT_WHILE(cond) while(cond) {}
+#endif
+
+/* clear the tx complete flag by writing a one, keep the other writable bits */
+#define CLEAR_TXC() UART_UCSRA = (UART_UCSRA & ((1<<U2X) | (1<<MPCM))) | (1<<TXC)
+
+/* write the multi-processor mode bit, leave TXC untouched */
+#define SET_MPCM(on) UART_UCSRA = (UART_UCSRA & (1<<U2X)) | ((on) ? (1<<MPCM) : 0)
 
-static uint8_t *volatile rxBufStart, *volatile rxBufEnd;
-static uint8_t *volatile txBufStart, *volatile txBufEnd;
-static uint8_t rxBuf[RX_BUFFERSIZE], txBuf[TX_BUFFERSIZE];
+#if MPCM_MODE
+static volatile uint8_t ownAddress = MPCM_ADDRESS;
 
-void uart_init()
+/* drop data frames unless 'addr' was addressed, or always receive */
+#define MPCM_FILTER(addr) (ownAddress != UART_MPCM_ALL && \
+        (addr) != ownAddress && (addr) != UART_MPCM_BROADCAST)
+#endif
+
+#if UART_LINE_DETECTION
+/* number of complete lines (delimiters) in the rx buffer */
+static volatile uint8_t rxLines;
+#if UART_LINE_CALLBACK
+static void (*volatile lineCallback)(void);
+#endif
+#endif
+
+/* set by the isr when the last byte of the buffer was loaded into UDR */
+static volatile uint8_t txDraining;
+static uint32_t currentBaud = BAUD;
+
+void UART_FN(init)()
 {
     /* set baudrate */
-    UBRRH = UBRRH_VALUE;
-    UBRRL = UBRRL_VALUE;
+    UART_UBRRH = UBRRH_VALUE;
+    UART_UBRRL = UBRRL_VALUE;
 
     /* double transmission speed? */
     #if USE_2X
-    UCSRA |= (1<<U2X);
+    UART_UCSRA |= (1<<U2X);
     #else
-    UCSRA &= ~(1<<U2X);
+    UART_UCSRA &= ~(1<<U2X);
     #endif
 
     /* frame format: asynchronous, 8 data bits, no parity, 1 stop bit */
     #ifdef URSEL
-    UCSRC = (1<<URSEL) | (1<<UCSZ1) | (1<<UCSZ0);
+    UART_UCSRC = (1<<URSEL) | (1<<UCSZ1) | (1<<UCSZ0);
     #else
-    UCSRC = (1<<UCSZ1) | (1<<UCSZ0);
+    UART_UCSRC = (1<<UCSZ1) | (1<<UCSZ0);
     #endif
 
+#if MPCM_MODE
+    /* 9 data bits, ignore data frames until we are addressed */
+    UART_UCSRB |= (1<<UCSZ2);
+    SET_MPCM(ownAddress != UART_MPCM_ALL);
+#endif
+
+#if RS485
+    /* transceiver in receive mode */
+    DE_PORT &= ~(1<<DE_PIN);
+    DE_DDR |= (1<<DE_PIN);
+#endif
+
+#if FLOW_CONTROL
+    /* rts output, asserted; cts input with change interrupt */
+    RTS_DDR |= (1<<RTS_PIN);
+    RTS_ASSERT();
+    CTS_DDR &= ~(1<<CTS_PIN);
+    CTS_INT_ENABLE();
+#endif
+
     /* enable receiver, transmitter and receive complete interrupt */
-    UCSRB |= (1<<RXCIE) | (1<<RXEN) | (1<<TXEN);
+    UART_UCSRB |= (1<<RXCIE) | (1<<RXEN) | (1<<TXEN);
+
+    /* init ring buffer indices */
+    ringbuf_init(&rxRing);
+    ringbuf_init(&txRing);
+}
+
+/* enables the tx register empty interrupt, unless the other side
+ * does not allow sending (cts deasserted)
+ */
+#if RS485
+/* takes the bus, the tx complete interrupt releases it */
+static inline void bus_take()
+{
+    DE_PORT |= (1<<DE_PIN);
+#if RS485_NO_ECHO
+    UART_UCSRB = (UART_UCSRB & ~(1<<RXEN)) | (1<<TXCIE);
+#else
+    UART_UCSRB |= (1<<TXCIE);
+#endif
+}
+#endif
+
+static inline void tx_start()
+{
+#if RS485
+    bus_take();
+#endif
+
+    if(CTS_ASSERTED())
+        UART_UCSRB |= (1<<UDRIE);
+}
 
-    /* init ring buffer pointers */
-    rxBufStart = rxBuf;
-    rxBufEnd = rxBuf;
-    txBufStart = txBuf;
-    txBufEnd = txBuf;
+/* called after data was taken from the rx buffer */
+static inline void rx_consumed()
+{
+#if FLOW_CONTROL
+    /* enough room again, let the other side continue */
+    if(RTS_DEASSERTED() && ringbuf_used(&rxRing, RX_BUFFERMASK) <= RTS_LOW_WATER)
+        RTS_ASSERT();
+#endif
 }
 
 /* sends single character
  * returns 1 on error
  */
-uint8_t uart_putc(char c)
+uint8_t UART_FN(putc)(char c)
 {
-    /* is the buffer full? */
+    /* add element to buffer, unless it is full */
 #if TX_BLOCK_ON_FULL_BUFFER
-	while((txBufEnd == &txBuf[TX_BUFFERSIZE-1] && txBufStart == txBuf) ||
-        txBufEnd == txBufStart-1) {}
+    WAIT_WHILE(ringbuf_free(&txRing, TX_BUFFERMASK) == 0);
+    ringbuf_put(&txRing, txBuf, TX_BUFFERMASK, c);
 #else
-    if((txBufEnd == &txBuf[TX_BUFFERSIZE-1] && txBufStart == txBuf) ||
-        txBufEnd == txBufStart-1) {
+    if(ringbuf_put(&txRing, txBuf, TX_BUFFERMASK, c) != 0)
         return 1;
-    }
 #endif
+    STATS_LEVEL(tx_high_water, ringbuf_used(&txRing, TX_BUFFERMASK));
 
-    /* add element to buffer */
-    *txBufEnd = c;
+    /* enable tx register empty interrupt */
+    tx_start();
 
-    /* set pointer to next field */
-    if(txBufEnd == &txBuf[TX_BUFFERSIZE-1])
-        txBufEnd = txBuf;
-    else
-        txBufEnd++;
+    return 0;
+}
+
+/* returns the number of free fields in the tx buffer */
+uint8_t UART_FN(free_space)()
+{
+    return ringbuf_free(&txRing, TX_BUFFERMASK);
+}
+
+/* copies up to len bytes into the tx buffer in at most two
+ * contiguous segments, returns number of copied bytes
+ */
+static uint8_t tx_buffer_write(const uint8_t *buf, uint8_t len)
+{
+    uint8_t n;
+
+    n = ringbuf_write(&txRing, txBuf, TX_BUFFERMASK, buf, len);
+    STATS_LEVEL(tx_high_water, ringbuf_used(&txRing, TX_BUFFERMASK));
 
     /* enable tx register empty interrupt */
-    UCSRB |= (1<<UDRIE);
+    if(n != 0)
+        tx_start();
 
-    return 0;
+    return n;
 }
 
-/* sends null-terminated character string
- * returns number of sent characters
+/* sends len bytes from buf
+ * returns number of bytes written to the tx buffer
+ */
+uint8_t UART_FN(write)(const uint8_t *buf, uint8_t len)
+{
+#if TX_BLOCK_ON_FULL_BUFFER
+    uint8_t count = 0;
+
+    while(count < len)  {
+        WAIT_WHILE(ringbuf_free(&txRing, TX_BUFFERMASK) == 0);
+        count += tx_buffer_write(buf + count, len - count);
+    }
+
+    return count;
+#else
+    return tx_buffer_write(buf, len);
+#endif
+}
+
+/* sends up to len bytes from buf, never blocks
+ * returns number of bytes written to the tx buffer
+ */
+uint8_t UART_FN(write_nb)(const uint8_t *buf, uint8_t len)
+{
+    return tx_buffer_write(buf, len);
+}
+
+/* copies up to len bytes from flash into the tx buffer
+ * returns number of copied bytes
+ */
+static uint8_t tx_buffer_write_P(const uint8_t *buf, uint8_t len)
+{
+    uint8_t n, count = 0;
+
+    while(count < len && (n = ringbuf_write_peek(&txRing, TX_BUFFERMASK)) != 0) {
+        if(n > len - count)
+            n = len - count;
+        memcpy_P(&txBuf[txRing.tail], buf + count, n);
+        ringbuf_write_commit(&txRing, TX_BUFFERMASK, n);
+        count += n;
+    }
+    STATS_LEVEL(tx_high_water, ringbuf_used(&txRing, TX_BUFFERMASK));
+
+    if(count != 0)
+        tx_start();
+
+    return count;
+}
+
+/* sends len bytes from buf in flash
+ * returns number of bytes written to the tx buffer
  */
-uint8_t uart_puts(char *s)
+uint8_t UART_FN(write_P)(const uint8_t *buf, uint8_t len)
 {
+#if TX_BLOCK_ON_FULL_BUFFER
     uint8_t count = 0;
-    while(*s)   {
-		if (uart_putc(*s) != 0)
-			break;
-		else {
-			count++;
-			s++;
-		}
+
+    while(count < len)  {
+        WAIT_WHILE(ringbuf_free(&txRing, TX_BUFFERMASK) == 0);
+        count += tx_buffer_write_P(buf + count, len - count);
     }
 
+    return count;
+#else
+    return tx_buffer_write_P(buf, len);
+#endif
+}
+
+/* sends null-terminated character string from flash
+ * returns number of sent characters
+ */
+uint8_t UART_FN(puts_P)(const char *s)
+{
+    size_t len = strlen_P(s);
+    uint8_t count = 0, n;
+
+    do {
+        n = UART_FN(write_P)((const uint8_t *)s, len > 255 ? 255 : len);
+        count += n;
+        s += n;
+        len -= n;
+    } while(n == 255 && len);
+
+    return count;
+}
+
+/* sends null-terminated character string
+ * returns number of sent characters
+ */
+uint8_t UART_FN(puts)(char *s)
+{
+    uint8_t count = 0, len, n;
+
+    do {
+        /* hand the string over in chunks of at most 255 bytes */
+        for(len = 0; s[len] && len < 255; len++) ;
+
+        n = UART_FN(write)((const uint8_t *)s, len);
+        count += n;
+        s += n;
+    } while(n == 255 && *s);
+
     return count;
 }
 
 /* converts the given byte into a 2-digit hex representation
  * and sends the two characters
  */
-uint8_t uart_putb(char byte)
+uint8_t UART_FN(putb)(char byte)
 {
 	uint8_t hn, ln;
 
@@ -99,72 +462,734 @@ uint8_t uart_putb(char byte)
 	hn = hn < 10 ? hn + '0' : hn + 'A'-10;
 	ln = ln < 10 ? ln + '0' : ln + 'A'-10;
 
-	if (uart_putc(hn) != 0)
+	if (UART_FN(putc)(hn) != 0)
 		return 1;
-	if (uart_putc(ln) != 0)
+	if (UART_FN(putc)(ln) != 0)
 		return 1;
 
 	return 0;
 }
 
+#if UART_PRINTF
+/* powers of ten for decimal output, digits are found by repeated
+ * subtraction instead of division */
+static const uint32_t pow10[] PROGMEM = {
+    1000000000, 100000000, 10000000, 1000000, 100000,
+    10000, 1000, 100, 10, 1
+};
+
+/* appends c to the tx buffer, the transmitter is only started when
+ * the buffer is full
+ * returns 1 if the buffer is full and we may not block
+ */
+static uint8_t tx_put(uint8_t c)
+{
+    if(ringbuf_put(&txRing, txBuf, TX_BUFFERMASK, c) != 0)  {
+        tx_start();
+#if TX_BLOCK_ON_FULL_BUFFER
+        WAIT_WHILE(ringbuf_free(&txRing, TX_BUFFERMASK) == 0);
+        ringbuf_put(&txRing, txBuf, TX_BUFFERMASK, c);
+#else
+        return 1;
+#endif
+    }
+    STATS_LEVEL(tx_high_water, ringbuf_used(&txRing, TX_BUFFERMASK));
+
+    return 0;
+}
+
+/* sends 'n' times 'c' */
+static uint8_t put_pad(uint8_t c, int8_t n)
+{
+    uint8_t count = 0;
+
+    while(n-- > 0 && tx_put(c) == 0)
+        count++;
+
+    return count;
+}
+
+/* sends val in decimal, with 'decimals' digits after the point */
+static uint8_t put_dec(uint32_t val, uint8_t neg, uint8_t width, uint8_t pad,
+        uint8_t decimals)
+{
+    uint8_t i, digit, count = 0, first = 0, len;
+    uint32_t p;
+
+    /* number of digits: skip leading zeros, keep one before the point */
+    while(first < 9 - decimals && pgm_read_dword(&pow10[first]) > val)
+        first++;
+    len = 10 - first + neg + (decimals ? 1 : 0);
+
+    if(pad == ' ')
+        count += put_pad(' ', width - len);
+    if(neg)
+        count += (tx_put('-') == 0);
+    if(pad == '0')
+        count += put_pad('0', width - len);
+
+    for(i = first; i < 10; i++) {
+        p = pgm_read_dword(&pow10[i]);
+        for(digit = '0'; val >= p; digit++)
+            val -= p;
+        count += (tx_put(digit) == 0);
+
+        if(decimals && 9 - i == decimals)
+            count += (tx_put('.') == 0);
+    }
+
+    return count;
+}
+
+/* sends val in hex with at least 'width' digits, 'alpha' is the
+ * character for ten ('a' or 'A') */
+static uint8_t put_hex(uint32_t val, uint8_t width, uint8_t pad, uint8_t nibbles,
+        char alpha)
+{
+    uint8_t n, count = 0;
+
+    /* skip leading zero nibbles, keep at least one */
+    while(nibbles > 1 && !(val >> ((nibbles-1) * 4)))
+        nibbles--;
+
+    count += put_pad(pad, width - nibbles);
+    while(nibbles--)    {
+        n = (val >> (nibbles * 4)) & 0x0F;
+        count += (tx_put(n < 10 ? n + '0' : n + alpha-10) == 0);
+    }
+
+    return count;
+}
+
+/* formats and sends fmt, reading it from flash if 'progmem' is set */
+static uint8_t vformat(const char *fmt, uint8_t progmem, va_list ap)
+{
+    uint8_t count = 0, width, pad, decimals, is_long;
+    const char *s;
+    char c;
+    int32_t val;
+
+#define NEXT() (progmem ? pgm_read_byte(fmt++) : *fmt++)
+    while((c = NEXT())) {
+        if(c != '%')    {
+            count += (tx_put(c) == 0);
+            continue;
+        }
+
+        /* flags, width, decimals, length */
+        pad = ' ';
+        width = decimals = is_long = 0;
+        if((c = NEXT()) == '0')  {
+            pad = '0';
+            c = NEXT();
+        }
+        for(; c >= '0' && c <= '9'; c = NEXT())
+            width = width * 10 + c - '0';
+        if(c == '.')    {
+            for(c = NEXT(); c >= '0' && c <= '9'; c = NEXT())
+                decimals = decimals * 10 + c - '0';
+            if(decimals > 9)
+                decimals = 9;
+        }
+        if(c == 'l')    {
+            is_long = 1;
+            c = NEXT();
+        }
+
+        switch(c)   {
+            case 'd':
+                val = is_long ? va_arg(ap, int32_t) : va_arg(ap, int);
+                count += put_dec(val < 0 ? -(uint32_t)val : (uint32_t)val, val < 0, width, pad,
+                        decimals);
+                break;
+            case 'u':
+                val = is_long ? va_arg(ap, uint32_t) : va_arg(ap, unsigned);
+                count += put_dec((uint32_t)val, 0, width, pad, decimals);
+                break;
+            case 'x':
+            case 'X':
+                val = is_long ? va_arg(ap, uint32_t) : va_arg(ap, unsigned);
+                count += put_hex((uint32_t)val, width, pad, is_long ? 8 : 4,
+                        c == 'x' ? 'a' : 'A');
+                break;
+            case 'c':
+                count += (tx_put(va_arg(ap, int)) == 0);
+                break;
+            case 's':
+                for(s = va_arg(ap, const char *); *s; s++)
+                    count += (tx_put(*s) == 0);
+                break;
+            case 'S':
+                for(s = va_arg(ap, const char *); pgm_read_byte(s); s++)
+                    count += (tx_put(pgm_read_byte(s)) == 0);
+                break;
+            case '\0':
+                fmt--;
+                break;
+            default:
+                count += (tx_put(c) == 0);
+                break;
+        }
+    }
+#undef NEXT
+
+    /* nothing to send (eg an empty string), with rs-485 the bus would
+     * be taken and never released */
+    if(!ringbuf_empty(&txRing))
+        tx_start();
+    return count;
+}
+
+/* printf-like output straight into the tx buffer
+ * returns number of sent characters
+ */
+uint8_t UART_FN(printf)(const char *fmt, ...)
+{
+    va_list ap;
+    uint8_t count;
+
+    va_start(ap, fmt);
+    count = vformat(fmt, 0, ap);
+    va_end(ap);
+
+    return count;
+}
+
+/* same as printf, the format string is read from flash */
+uint8_t UART_FN(printf_P)(const char *fmt, ...)
+{
+    va_list ap;
+    uint8_t count;
+
+    va_start(ap, fmt);
+    count = vformat(fmt, 1, ap);
+    va_end(ap);
+
+    return count;
+}
+#endif
+
+#if UART_LINE_DETECTION
+/* keeps the line count up to date, call with the bytes taken
+ * from the rx buffer */
+static void lines_consumed(const uint8_t *buf, uint8_t n)
+{
+    uint8_t lines = 0;
+
+    while(n--)
+        if(*buf++ == UART_LINE_DELIMITER)
+            lines++;
+
+    if(lines)   {
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE)   {
+            rxLines -= lines;
+        }
+    }
+}
+#else
+#define lines_consumed(buf, n)
+#endif
+
 /* receives a character and stores it in 'dest'
  * returnes 1 if there is nothing in the buffer
  */
-uint8_t uart_getc(char *dest)
+uint8_t UART_FN(getc)(char *dest)
 {
-    /* is the buffer empty? */
-    if(rxBufStart == rxBufEnd)  {
+    if(ringbuf_get(&rxRing, rxBuf, RX_BUFFERMASK, (uint8_t *)dest) != 0)
         return 1;
-    }
 
-    /* get element from buffer */
-    *dest = *rxBufStart;
+    lines_consumed((uint8_t *)dest, 1);
+    rx_consumed();
+    return 0;
+}
 
-    /* set pointer to next field */
-    if(rxBufStart == &rxBuf[RX_BUFFERSIZE-1])
-        rxBufStart = rxBuf;
-    else
-        rxBufStart++;
+/* returns the number of received bytes in the rx buffer */
+uint8_t UART_FN(available)()
+{
+    return ringbuf_used(&rxRing, RX_BUFFERMASK);
+}
+
+/* copies up to n bytes from the rx buffer into buf in at most two
+ * contiguous segments, returns number of copied bytes
+ */
+uint8_t UART_FN(read)(uint8_t *buf, uint8_t n)
+{
+    n = ringbuf_read(&rxRing, rxBuf, RX_BUFFERMASK, buf, n);
+    lines_consumed(buf, n);
+    rx_consumed();
+
+    return n;
+}
+
+/* waits until the rx buffer is not empty, at most timeout_ms
+ * milliseconds (0: wait forever)
+ * returns 1 on timeout
+ */
+static uint8_t rx_wait(uint16_t timeout_ms)
+{
+    uint8_t forever = (timeout_ms == 0), ticks = 0;
+
+    if(forever) {
+        WAIT_WHILE(ringbuf_empty(&rxRing));
+        return 0;
+    }
+
+    while(ringbuf_empty(&rxRing))   {
+        _delay_us(100);
+        if(++ticks == 10)   {
+            ticks = 0;
+            if(--timeout_ms == 0)
+                return 1;
+        }
+    }
 
     return 0;
 }
 
+/* reads into buf until delim was copied or size bytes were read
+ * returns number of copied bytes
+ */
+uint8_t UART_FN(read_until)(char *buf, uint8_t size, char delim,
+        uint16_t timeout_ms)
+{
+    uint8_t count = 0;
+
+    while(count < size) {
+        if(rx_wait(timeout_ms) != 0)
+            break;
+
+        UART_FN(getc)(&buf[count]);
+        if(buf[count++] == delim)
+            break;
+    }
+
+    return count;
+}
+
+#if UART_LINE_DETECTION
+/* returns the number of complete lines in the rx buffer */
+uint8_t UART_FN(lines_available)()
+{
+    return rxLines;
+}
+
+/* copies the next line including the delimiter into buf, or the
+ * buffered part of a line that does not fit into the rx buffer
+ * returns number of copied bytes, 0 if there is no complete line
+ */
+uint8_t UART_FN(read_line)(char *buf, uint8_t size)
+{
+    uint8_t count = 0, n;
+    uint8_t *seg, *end;
+
+    /* a full buffer without a delimiter would stall the input forever
+     * (with flow control it stalls at the rts high water mark) */
+#if FLOW_CONTROL
+    if(rxLines == 0 && ringbuf_used(&rxRing, RX_BUFFERMASK) < RTS_HIGH_WATER)
+        return 0;
+#else
+    if(rxLines == 0 && ringbuf_free(&rxRing, RX_BUFFERMASK) != 0)
+        return 0;
+#endif
+
+    /* at most two segments, up to the delimiter */
+    while(count < size && (n = ringbuf_read_peek(&rxRing, RX_BUFFERMASK)) != 0) {
+        if(n > size - count)
+            n = size - count;
+
+        seg = &rxBuf[rxRing.head];
+        end = memchr(seg, UART_LINE_DELIMITER, n);
+        if(end)
+            n = end - seg + 1;
+
+        memcpy(buf + count, seg, n);
+        ringbuf_read_commit(&rxRing, RX_BUFFERMASK, n);
+        count += n;
+
+        if(end) {
+            lines_consumed((uint8_t *)end, 1);
+            break;
+        }
+    }
+
+    rx_consumed();
+    return count;
+}
+
+#if UART_LINE_CALLBACK
+/* sets the function called from the rx interrupt for every line */
+void UART_FN(set_line_callback)(void (*callback)(void))
+{
+    /* the pointer takes two writes, the isr must not see half of it */
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)   {
+        lineCallback = callback;
+    }
+}
+#endif
+#endif
+
+#if UART_STATS
+/* copies the current statistics to 'dest' */
+void UART_FN(get_stats)(uart_stats_t *dest)
+{
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)   {
+        memcpy(dest, &stats, sizeof(stats));
+    }
+}
+
+/* sets all counters and high-water marks to zero */
+void UART_FN(reset_stats)()
+{
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)   {
+        memset(&stats, 0, sizeof(stats));
+    }
+}
+#endif
+
 /* uart receive complete interrupt */
-ISR(RX_COMPL_INT)
+ISR(UART_RX_VECT)
 {
     uint8_t rc;
-    rc = UDR;
+#if UART_STATS
+    /* error flags are only valid until UDR is read */
+    uint8_t status = UART_UCSRA;
+#endif
+#if MPCM_MODE
+    /* so is the ninth bit */
+    uint8_t address_frame = UART_UCSRB & (1<<RXB8);
+#endif
+    rc = UART_UDR;
 
-    /* store in buffer */
-    if((rxBufEnd == &rxBuf[RX_BUFFERSIZE-1] &&
-        rxBufStart == rxBuf) ||
-        rxBufEnd == rxBufStart-1)   {
+#if UART_STATS
+    STATS_INC(rx_bytes);
+    if(status & (1<<FE))
+        STATS_INC(frame_errors);
+    if(status & (1<<DOR))
+        STATS_INC(hw_overruns);
+    if(status & (1<<UPE))
+        STATS_INC(parity_errors);
+#endif
 
+#if MPCM_MODE
+    if(address_frame)   {
+        /* receive the following data frames only if we are addressed,
+         * the hardware drops them otherwise */
+        SET_MPCM(MPCM_FILTER(rc));
         return;
     }
-    else    {
-        *rxBufEnd = rc;
+#endif
 
-        if(rxBufEnd == &rxBuf[RX_BUFFERSIZE-1])
-            rxBufEnd = rxBuf;
-        else
-            rxBufEnd++;
+    /* store in buffer, drop the byte if the buffer is full */
+    if(ringbuf_put(&rxRing, rxBuf, RX_BUFFERMASK, rc) != 0)    {
+        STATS_INC(sw_overruns);
+    }
+#if UART_LINE_DETECTION
+    else if(rc == UART_LINE_DELIMITER)  {
+        rxLines++;
+#if UART_LINE_CALLBACK
+        if(lineCallback)
+            lineCallback();
+#endif
     }
+#endif
+    STATS_LEVEL(rx_high_water, ringbuf_used(&rxRing, RX_BUFFERMASK));
+
+#if FLOW_CONTROL
+    /* input buffer almost full, ask the other side to pause */
+    if(ringbuf_used(&rxRing, RX_BUFFERMASK) >= RTS_HIGH_WATER)
+        RTS_DEASSERT();
+#endif
 }
 
+/* waits until the tx buffer is empty and the last stop bit left the
+ * shift register
+ */
+void UART_FN(flush)()
+{
+    /* every tx register empty interrupt wakes us up */
+    WAIT_WHILE(!ringbuf_empty(&txRing) || (UART_UCSRB & (1<<UDRIE)));
+
+    /* wait for the tx complete interrupt of the last byte, the flag
+     * is already pending if it left meanwhile */
+    if(txDraining)  {
+        UART_UCSRB |= (1<<TXCIE);
+        WAIT_WHILE(txDraining);
+    }
+}
+
+/* slowest rate: UBRR 4095 at normal speed, fastest: UBRR 0 at double speed */
+#define BAUD_MIN ((F_CPU)/(16*4096UL) + 1)
+#define BAUD_MAX ((F_CPU)/8)
+
+/* calculates UBRR and U2X for the baudrate in 'baud', rates out of
+ * range are clamped and 'baud' is set to the clamped rate (the error
+ * shows the difference to the requested one)
+ * returns the error of the resulting rate in 0.1%
+ */
+static int16_t baud_calc(uint32_t *baud, uint16_t *ubrr, uint8_t *u2x)
+{
+    uint8_t div = 16;
+    uint32_t rate = *baud, val, actual, q;
+    int32_t err, best = 0;
+
+    if(rate < BAUD_MIN)
+        rate = BAUD_MIN;
+    if(rate > BAUD_MAX)
+        rate = BAUD_MAX;
+
+    /* try normal speed first, prefer it if double speed is not better */
+    for(*u2x = 0; div >= 8; div /= 2)   {
+        val = (F_CPU + div/2 * rate) / (div * rate);
+        if(val > 0)
+            val--;
+        if(val > 4095)
+            val = 4095;
+
+        /* error relative to the requested rate, rounded towards zero.
+         * actual * 1000 does not overflow, actual is at most F_CPU/8 */
+        actual = F_CPU / (div * (val+1));
+        if(*baud == 0)   {
+            err = INT16_MAX;
+        } else  {
+            q = actual * 1000 / *baud;
+            if(actual < *baud && actual * 1000 % *baud)
+                q++;
+            err = q > 1000 + INT16_MAX ? INT16_MAX : (int32_t)q - 1000;
+        }
+
+        if(div == 16 || (err < 0 ? -err : err) < (best < 0 ? -best : best))    {
+            best = err;
+            *ubrr = val;
+            *u2x = (div == 8);
+        }
+    }
+
+    *baud = rate;
+    return best;
+}
+
+/* switches to the given baudrate after all pending data was sent
+ * returns the error of the resulting rate in 0.1%
+ */
+int16_t UART_FN(set_baud)(uint32_t baud)
+{
+    uint16_t ubrr;
+    uint8_t u2x;
+    int16_t err;
+
+    err = baud_calc(&baud, &ubrr, &u2x);
+
+    UART_FN(flush)();
+
+    UART_UBRRH = ubrr >> 8;
+    UART_UBRRL = ubrr;
+    if(u2x)
+        UART_UCSRA |= (1<<U2X);
+    else
+        UART_UCSRA &= ~(1<<U2X);
+
+    currentBaud = baud;
+    return err;
+}
+
+/* returns the baudrate set by init() or set_baud(), after clamping */
+uint32_t UART_FN(get_baud)()
+{
+    return currentBaud;
+}
+
+#if MPCM_MODE
+/* sets the own node address, data frames are ignored until the next
+ * address frame with this address (or the broadcast address), with
+ * UART_MPCM_ALL they are all received
+ */
+void UART_FN(set_address)(uint8_t addr)
+{
+    ownAddress = addr;
+    SET_MPCM(addr != UART_MPCM_ALL);
+}
+
+/* sends an address frame (ninth bit set) after all pending data
+ */
+void UART_FN(send_address)(uint8_t addr)
+{
+    UART_FN(flush)();
+#if RS485
+    bus_take();
+#endif
+
+    UART_UCSRB |= (1<<TXB8);
+    UART_UDR = addr;
+    CLEAR_TXC();
+    txDraining = 1;
+
+    /* the ninth bit is latched once the frame moved to the shift register */
+    while(!(UART_UCSRA & (1<<UDRE))) {}
+    UART_UCSRB &= ~(1<<TXB8);
+}
+#endif
+
+#if UART_BAUD_NEGOTIATION
+static uint8_t read_byte(uint8_t *c)
+{
+    if(rx_wait(UART_NEGOTIATION_TIMEOUT) != 0)
+        return 1;
+    return UART_FN(getc)((char *)c);
+}
+
+/* switches to 'baud' and exchanges sync bytes and a confirmation with
+ * the other side, falls back to the previous baudrate on failure
+ * returns 0 on success
+ */
+static uint8_t switch_and_sync(uint32_t baud, uint8_t initiator)
+{
+    uint32_t old = currentBaud;
+    uint8_t c;
+
+    UART_FN(set_baud)(baud);
+
+    /* discard anything received at the old rate */
+    while(UART_FN(getc)((char *)&c) == 0) {}
+
+    if(initiator)   {
+        /* give the other side some time to switch */
+        _delay_ms(2);
+        UART_FN(putc)(UART_NEGOTIATION_SYNC);
+
+        /* the echo shows the other side got our sync, the ack tells it
+         * that we got the echo */
+        if(read_byte(&c) == 0 && c == UART_NEGOTIATION_SYNC)   {
+            UART_FN(putc)(UART_NEGOTIATION_ACK);
+            return 0;
+        }
+    } else if(read_byte(&c) == 0 && c == UART_NEGOTIATION_SYNC)    {
+        /* keep the new rate only if the other side got the echo */
+        UART_FN(putc)(UART_NEGOTIATION_SYNC);
+        if(read_byte(&c) == 0 && c == UART_NEGOTIATION_ACK)
+            return 0;
+    }
+
+    UART_FN(set_baud)(old);
+    return 1;
+}
+
+/* proposes the rates in 'rates' (fastest first) to the other side
+ * returns the baudrate both sides agreed on
+ */
+uint32_t UART_FN(negotiate_baud)(const uint32_t *rates, uint8_t count,
+        uint8_t max_error)
+{
+    uint32_t rate;
+    uint16_t ubrr;
+    uint8_t u2x, c, i;
+    int16_t err;
+
+    for(i = 0; i < count; i++)  {
+        /* the rate we run at is compared after clamping */
+        rate = rates[i];
+        err = baud_calc(&rate, &ubrr, &u2x);
+        if(rate == currentBaud)
+            break;
+
+        if((err < 0 ? -err : err) > max_error)
+            continue;
+
+        UART_FN(putc)(UART_NEGOTIATION_REQUEST);
+        UART_FN(write)((const uint8_t *)&rates[i], sizeof(rates[i]));
+
+        if(read_byte(&c) != 0 || c != UART_NEGOTIATION_ACK)
+            continue;
+
+        if(switch_and_sync(rates[i], 1) == 0)
+            break;
+    }
+
+    return currentBaud;
+}
+
+/* answers a baudrate proposal, call after UART_NEGOTIATION_REQUEST
+ * was received
+ * returns the baudrate both sides agreed on
+ */
+uint32_t UART_FN(negotiate_answer)(uint8_t max_error)
+{
+    uint32_t baud;
+    uint16_t ubrr;
+    uint8_t u2x, i;
+    int16_t err;
+
+    for(i = 0; i < sizeof(baud); i++)   {
+        if(read_byte((uint8_t *)&baud + i) != 0)
+            return currentBaud;
+    }
+
+    err = baud_calc(&baud, &ubrr, &u2x);
+    if((err < 0 ? -err : err) > max_error)  {
+        UART_FN(putc)(UART_NEGOTIATION_NAK);
+        return currentBaud;
+    }
+
+    UART_FN(putc)(UART_NEGOTIATION_ACK);
+    switch_and_sync(baud, 0);
+
+    return currentBaud;
+}
+#endif
+
 /* uart transmit register empty interrupt */
-ISR(TX_REG_EMPTY_INT)
+ISR(UART_UDRE_VECT)
 {
+    uint8_t c;
+
+#if FLOW_CONTROL
+    /* the other side asked us to pause, the cts interrupt resumes */
+    if(!CTS_ASSERTED()) {
+        UART_UCSRB &= ~(1<<UDRIE);
+        return;
+    }
+#endif
+
     /* send byte */
-    UDR = *txBufStart;
+    if(ringbuf_get(&txRing, txBuf, TX_BUFFERMASK, &c) == 0)   {
+        UART_UDR = c;
+        STATS_INC(tx_bytes);
 
-    /* set pointer to next field */
-    if(txBufStart == &txBuf[TX_BUFFERSIZE-1])
-        txBufStart = txBuf;
-    else
-        txBufStart++;
+        if(ringbuf_empty(&txRing))  {
+            /* that was the last byte and UDR is full, so the tx complete
+             * flag will be set after the stop bit of this byte */
+            CLEAR_TXC();
+            txDraining = 1;
+        }
+    }
 
     /* buffer empty? disable interrupt */
-    if(txBufStart == txBufEnd)
-        UCSRB &= ~(1<<UDRIE);
+    if(ringbuf_empty(&txRing))
+        UART_UCSRB &= ~(1<<UDRIE);
+}
+
+#if FLOW_CONTROL
+/* cts changed, resume or pause the transmitter */
+ISR(CTS_VECT)
+{
+    if(CTS_ASSERTED() && !ringbuf_empty(&txRing))
+        UART_UCSRB |= (1<<UDRIE);
+    else
+        UART_UCSRB &= ~(1<<UDRIE);
+}
+#endif
+
+/* uart transmit complete interrupt - the last stop bit has left */
+ISR(UART_TXC_VECT)
+{
+    /* more data queued meanwhile? keep the bus */
+    if(!ringbuf_empty(&txRing))
+        return;
+
+    txDraining = 0;
+#if RS485
+    DE_PORT &= ~(1<<DE_PIN);
+    UART_UCSRB = (UART_UCSRB & ~(1<<TXCIE)) | (1<<RXEN);
+#else
+    UART_UCSRB &= ~(1<<TXCIE);
+#endif
 }
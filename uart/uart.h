@@ -6,6 +6,7 @@
 #endif
 
 #include <stdint.h>
+#include <avr/pgmspace.h>
 
 #ifndef BAUD
 #ifdef UART_BAUD_RATE
@@ -15,6 +16,7 @@
 #endif
 #endif
 
+/* buffer sizes must be a power of 2 (up to 256) */
 #ifndef RX_BUFFERSIZE
 #define RX_BUFFERSIZE 16
 #endif
@@ -23,23 +25,236 @@
 #define TX_BUFFERSIZE 32
 #endif
 
+/* if set to 1 RTS/CTS hardware flow control is used. RTS is an output,
+ * driven high (deasserted) when the input buffer holds UART_RTS_HIGH_WATER
+ * bytes and low again when it dropped to UART_RTS_LOW_WATER. CTS is an
+ * input, data is only sent while it is low. every change of CTS must
+ * trigger the interrupt UART_CTS_vect, UART_CTS_INT_ENABLE() sets it up. */
+#ifndef UART_FLOW_CONTROL
+#define UART_FLOW_CONTROL 0
+#endif
+
+#if UART_FLOW_CONTROL
+#ifndef UART_RTS_PORT
+#define UART_RTS_PORT PORTD
+#define UART_RTS_DDR DDRD
+#define UART_RTS_PIN PD4
+#endif
+
+/* default: INT0 (PD2), interrupt on any change. the registers to set it
+ * up differ, other devices need all UART_CTS_* defined */
+#ifndef UART_CTS_PINREG
+#define UART_CTS_PINREG PIND
+#define UART_CTS_DDR DDRD
+#define UART_CTS_PIN PD2
+#define UART_CTS_vect INT0_vect
+
+#if defined(__AVR_ATmega8__) || defined(__AVR_ATmega16__) || \
+    defined(__AVR_ATmega32__) || defined(__AVR_ATmega8535__)
+    #define UART_CTS_INT_ENABLE() \
+        do { MCUCR |= (1<<ISC00); GICR |= (1<<INT0); } while(0)
+
+#elif defined(__AVR_ATtiny2313__)
+    #define UART_CTS_INT_ENABLE() \
+        do { MCUCR |= (1<<ISC00); GIMSK |= (1<<INT0); } while(0)
+
+#elif defined(__AVR_ATmega644__) || \
+    defined(__AVR_ATmega164P__) || defined(__AVR_ATmega164PA__) || \
+    defined(__AVR_ATmega324P__) || defined(__AVR_ATmega324PA__) || \
+    defined(__AVR_ATmega644P__) || defined(__AVR_ATmega644PA__) || \
+    defined(__AVR_ATmega1284__) || defined(__AVR_ATmega1284P__)
+    #define UART_CTS_INT_ENABLE() \
+        do { EICRA |= (1<<ISC00); EIMSK |= (1<<INT0); } while(0)
+
+#else
+    #error "no default cts pin for this device, define UART_CTS_PINREG, UART_CTS_DDR, UART_CTS_PIN, UART_CTS_vect and UART_CTS_INT_ENABLE()"
+#endif
+#endif
+
+/* leave some room for bytes the other side sends before it reacts */
+#ifndef UART_RTS_HIGH_WATER
+#define UART_RTS_HIGH_WATER (RX_BUFFERSIZE-4)
+#endif
+#ifndef UART_RTS_LOW_WATER
+#define UART_RTS_LOW_WATER (RX_BUFFERSIZE/4)
+#endif
+#endif
+
+/* if set to 1 the driver controls the driver enable (DE) pin of an rs-485
+ * transceiver: DE is driven high when data is written to the empty output
+ * buffer and low again from the tx complete interrupt, right after the
+ * stop bit of the last byte. with UART_RS485_NO_ECHO the receiver is
+ * disabled meanwhile (for transceivers with RE tied to ground). */
+#ifndef UART_RS485
+#define UART_RS485 0
+#endif
+
+#if UART_RS485
+#ifndef UART_RS485_DE_PORT
+#define UART_RS485_DE_PORT PORTD
+#define UART_RS485_DE_DDR DDRD
+#define UART_RS485_DE_PIN PD5
+#endif
+
+#ifndef UART_RS485_NO_ECHO
+#define UART_RS485_NO_ECHO 0
+#endif
+#endif
+
+/* if set to 1 the usart uses 9-bit frames in multi-processor
+ * communication mode: frames with the ninth bit set carry a node address.
+ * data frames are dropped by the hardware (no interrupt) until an address
+ * frame matches the own address or UART_MPCM_BROADCAST. */
+#ifndef UART_MPCM
+#define UART_MPCM 0
+#endif
+
+#ifndef UART_MPCM_ADDRESS
+#define UART_MPCM_ADDRESS 0x01
+#endif
+
+#ifndef UART_MPCM_BROADCAST
+#define UART_MPCM_BROADCAST 0xFF
+#endif
+
+/* own address that turns the filter off: every data frame is received,
+ * eg for the bus master that reads the replies of the nodes. use it for
+ * UART_MPCM_ADDRESS or with uart_set_address(). */
+#define UART_MPCM_ALL UART_MPCM_BROADCAST
+
+/* if set to 1 the rx interrupt counts received UART_LINE_DELIMITER
+ * characters, see uart_lines_available() and uart_read_line().
+ * UART_LINE_CALLBACK adds uart_set_line_callback() (note: a function
+ * call makes the rx interrupt save more registers for every byte). */
+#ifndef UART_LINE_DETECTION
+#define UART_LINE_DETECTION 0
+#endif
+
+#ifndef UART_LINE_DELIMITER
+#define UART_LINE_DELIMITER '\n'
+#endif
+
+#ifndef UART_LINE_CALLBACK
+#define UART_LINE_CALLBACK 0
+#endif
+
+/* if set to 1 uart_printf() and uart_printf_P() are available */
+#ifndef UART_PRINTF
+#define UART_PRINTF 0
+#endif
+
+/* settings of the second usart (uart1_* functions, compile uart1.c) */
+#ifndef UART1_BAUD_RATE
+#define UART1_BAUD_RATE 9600
+#endif
+
+#ifndef UART1_RX_BUFFERSIZE
+#define UART1_RX_BUFFERSIZE 16
+#endif
+
+#ifndef UART1_TX_BUFFERSIZE
+#define UART1_TX_BUFFERSIZE 32
+#endif
+
+/* flow control of the second usart, UART1_RTS_* and UART1_CTS_* are
+ * defined like their UART_* counterparts above (no defaults) */
+#ifndef UART1_FLOW_CONTROL
+#define UART1_FLOW_CONTROL 0
+#endif
+
+#ifndef UART1_MPCM
+#define UART1_MPCM 0
+#endif
+
+#ifndef UART1_MPCM_ADDRESS
+#define UART1_MPCM_ADDRESS 0x01
+#endif
+
+/* rs-485 mode of the second usart, define UART1_RS485_DE_* and
+ * UART1_RS485_NO_ECHO like their UART_RS485_* counterparts */
+#ifndef UART1_RS485
+#define UART1_RS485 0
+#endif
+
 /* if set to 1 sending will block execution until all data
  * is written to the output buffer */
 #ifndef TX_BLOCK_ON_FULL_BUFFER
 #define TX_BLOCK_ON_FULL_BUFFER 1
 #endif
 
+/* if set to 1 the interrupt routines keep byte, error and buffer
+ * usage counters, see uart_get_stats() */
+#ifndef UART_STATS
+#define UART_STATS 0
+#endif
+
+/* if set to 1 uart_negotiate_baud()/uart_negotiate_answer() are
+ * available to switch both sides of the link to a faster baudrate */
+#ifndef UART_BAUD_NEGOTIATION
+#define UART_BAUD_NEGOTIATION 0
+#endif
+
+/* milliseconds to wait for an answer while negotiating */
+#ifndef UART_NEGOTIATION_TIMEOUT
+#define UART_NEGOTIATION_TIMEOUT 100
+#endif
+
+/* bytes exchanged while negotiating */
+#define UART_NEGOTIATION_REQUEST    0xB5
+#define UART_NEGOTIATION_ACK        0x06
+#define UART_NEGOTIATION_NAK        0x15
+#define UART_NEGOTIATION_SYNC       0x55
+
+/* if set to 1 blocking functions put the cpu into idle sleep mode until
+ * the next interrupt instead of busy waiting (the timer interrupts etc of
+ * the application wake it up too) */
+#ifndef UART_SLEEP_WHILE_BLOCKED
+#define UART_SLEEP_WHILE_BLOCKED 0
+#endif
+
 #if defined(__AVR_ATmega8__) || defined(__AVR_ATmega32__)
     #define RX_COMPL_INT USART_RXC_vect
     #define TX_REG_EMPTY_INT USART_UDRE_vect
+    #define TX_COMPL_INT USART_TXC_vect
 
 #elif defined(__AVR_ATtiny2313__) || defined(__AVR_ATmega8535__)
     #define RX_COMPL_INT USART_RX_vect
     #define TX_REG_EMPTY_INT USART_UDRE_vect
+    #define TX_COMPL_INT USART_TX_vect
+
+#elif defined(__AVR_ATmega644__)
+    #define RX_COMPL_INT USART0_RX_vect
+    #define TX_REG_EMPTY_INT USART0_UDRE_vect
+    #define TX_COMPL_INT USART0_TX_vect
+
+#elif defined(__AVR_ATmega164P__) || defined(__AVR_ATmega164PA__) || \
+    defined(__AVR_ATmega324P__) || defined(__AVR_ATmega324PA__) || \
+    defined(__AVR_ATmega644P__) || defined(__AVR_ATmega644PA__) || \
+    defined(__AVR_ATmega1284__) || defined(__AVR_ATmega1284P__)
+    #define RX_COMPL_INT USART0_RX_vect
+    #define TX_REG_EMPTY_INT USART0_UDRE_vect
+    #define TX_COMPL_INT USART0_TX_vect
+
+    #define UART1_AVAILABLE 1
+    #define UART1_RX_COMPL_INT USART1_RX_vect
+    #define UART1_TX_REG_EMPTY_INT USART1_UDRE_vect
+    #define UART1_TX_COMPL_INT USART1_TX_vect
 
 #endif
 
 
+typedef struct {
+    uint16_t rx_bytes;          /* received bytes, including dropped ones */
+    uint16_t tx_bytes;          /* bytes moved into the transmit register */
+    uint16_t sw_overruns;       /* received bytes dropped, input buffer full */
+    uint16_t hw_overruns;       /* data overrun (DOR) flagged by the usart */
+    uint16_t frame_errors;      /* frame error (FE), invalid stop bit */
+    uint16_t parity_errors;     /* parity error (UPE) */
+    uint8_t rx_high_water;      /* max number of bytes in the input buffer */
+    uint8_t tx_high_water;      /* max number of bytes in the output buffer */
+} uart_stats_t;
+
+
 /*
  * initializes uart hardware and library - call once at start.
  * enable interrupts before sending data.
@@ -58,6 +273,48 @@ uint8_t uart_putc(char c);
  */
 uint8_t uart_puts(char *s);
 
+/*
+ * sends 'len' bytes from 'buf'. the data is copied into the output
+ * buffer in one go instead of byte by byte.
+ * with TX_BLOCK_ON_FULL_BUFFER set this waits until all bytes fit.
+ *
+ * returns the number of bytes written to the output buffer
+ */
+uint8_t uart_write(const uint8_t *buf, uint8_t len);
+
+/*
+ * same as uart_write() but never blocks, bytes that do not fit
+ * into the output buffer are not sent.
+ *
+ * returns the number of bytes written to the output buffer
+ */
+uint8_t uart_write_nb(const uint8_t *buf, uint8_t len);
+
+/*
+ * waits until all data in the output buffer was sent and the stop bit
+ * of the last byte has left the uart
+ */
+void uart_flush();
+
+/*
+ * returns the number of bytes that can be written to the output
+ * buffer without blocking (eg to check whether a whole frame fits)
+ */
+uint8_t uart_free_space();
+
+/*
+ * same as uart_puts(), uart_write() but the data is read directly from
+ * flash (PROGMEM), no copy in ram is needed
+ */
+uint8_t uart_puts_P(const char *s);
+uint8_t uart_write_P(const uint8_t *buf, uint8_t len);
+
+/*
+ * sends a string literal that is kept in flash only,
+ * eg uart_puts_PSTR("hello\n")
+ */
+#define uart_puts_PSTR(s) uart_puts_P(PSTR(s))
+
 /*
  * sends the 2-digit hex representation of byte
  * (eg (dec)42 becomes "2A")
@@ -66,10 +323,211 @@ uint8_t uart_puts(char *s);
  */
 uint8_t uart_putb(char byte);
 
+#if UART_PRINTF
+/*
+ * small printf replacement, writes straight into the output buffer
+ * (no vfprintf, no intermediate string buffer). supported conversions:
+ *
+ *   %d %u     int / unsigned int in decimal (%ld %lu: 32-bit)
+ *   %x %X     unsigned int in lower/upper case hex (%lx: 32-bit)
+ *   %c %s     character, string in ram
+ *   %S        string in flash (PROGMEM)
+ *   %%        percent sign
+ *
+ * an optional '0' flag and width pad numbers (eg "%04X"). ".N" prints a
+ * fixed-point number with N decimals: "%.1d" prints 235 as "23.5".
+ *
+ * returns the number of characters written to the output buffer
+ */
+uint8_t uart_printf(const char *fmt, ...);
+
+/*
+ * same as uart_printf(), but 'fmt' is a string in flash,
+ * eg uart_printf_P(PSTR("%u sensors\n"), count)
+ */
+uint8_t uart_printf_P(const char *fmt, ...);
+#endif
+
 /*
  * reads one character from the uart and stores it in 'c'
  * returns non-zero if the input buffer is empty (nothing received)
  */
 uint8_t uart_getc(char *c);
 
+/*
+ * returns the number of bytes available in the input buffer
+ */
+uint8_t uart_available();
+
+/*
+ * moves up to 'n' bytes from the input buffer to 'buf'
+ *
+ * returns the number of bytes written to 'buf'
+ */
+uint8_t uart_read(uint8_t *buf, uint8_t n);
+
+/*
+ * reads from the input buffer into 'buf' until the character 'delim'
+ * was copied or 'size' bytes were read. waits for incoming data at most
+ * 'timeout_ms' milliseconds per byte, 0 waits forever.
+ *
+ * returns the number of bytes written to 'buf' (including 'delim')
+ */
+uint8_t uart_read_until(char *buf, uint8_t size, char delim,
+        uint16_t timeout_ms);
+
+/*
+ * switches to 'baud' at runtime (eg 250000, 500000 or 1000000 with a
+ * 16MHz crystal). waits until all pending data was sent before the
+ * switch. the double speed mode is used if it gives a smaller error.
+ * rates below F_CPU/65536 or above F_CPU/8 are clamped to that range.
+ *
+ * returns the error of the resulting baudrate in 0.1% steps
+ * (eg -21 means the rate is 2.1% too slow)
+ */
+int16_t uart_set_baud(uint32_t baud);
+
+/*
+ * returns the currently configured baudrate (clamped like in
+ * uart_set_baud(), the hardware rate differs by the error it returned)
+ */
+uint32_t uart_get_baud();
+
+#if UART_BAUD_NEGOTIATION
+/*
+ * proposes the baudrates in 'rates' (ordered fastest first, the list
+ * should end with the current rate) to the other side. rates with an
+ * error above 'max_error' (in 0.1%) on this side are skipped.
+ *
+ * for each proposal UART_NEGOTIATION_REQUEST and the rate (4 bytes,
+ * lsb first) are sent. if the other side answers UART_NEGOTIATION_ACK
+ * both switch, this side sends UART_NEGOTIATION_SYNC at the new rate,
+ * the other side echoes it and this side confirms the echo with
+ * UART_NEGOTIATION_ACK. a side that misses a byte of this exchange
+ * falls back to the previous rate and the next one is tried. only if
+ * the final ack is lost the sides end up at different rates: the
+ * other side falls back, this side does not notice.
+ *
+ * returns the baudrate in use afterwards
+ */
+uint32_t uart_negotiate_baud(const uint32_t *rates, uint8_t count,
+        uint8_t max_error);
+
+/*
+ * answers a proposal of the other side. call after receiving
+ * UART_NEGOTIATION_REQUEST. 'max_error' (in 0.1%) is the largest
+ * acceptable error on this side.
+ *
+ * returns the baudrate in use afterwards
+ */
+uint32_t uart_negotiate_answer(uint8_t max_error);
+#endif
+
+#if UART_LINE_DETECTION
+/*
+ * returns the number of complete lines (terminated by UART_LINE_DELIMITER)
+ * in the input buffer
+ */
+uint8_t uart_lines_available();
+
+/*
+ * copies the next complete line, including the delimiter, to 'buf'. a line
+ * longer than 'size' is returned in parts, the last one ends with the
+ * delimiter. so is a line that does not fit into the input buffer: once
+ * the buffer is full (with flow control: rts was deasserted) its content
+ * is returned without a delimiter.
+ *
+ * returns the number of bytes written to 'buf', 0 if there is no
+ * complete line in the input buffer
+ */
+uint8_t uart_read_line(char *buf, uint8_t size);
+
+#if UART_LINE_CALLBACK
+/*
+ * sets a function that is called from the rx interrupt every time
+ * a delimiter was received (NULL disables it). keep it short.
+ */
+void uart_set_line_callback(void (*callback)(void));
+#endif
+#endif
+
+#if UART_MPCM
+/*
+ * sets the address of this node. received data frames are dropped until
+ * an address frame with 'addr' (or UART_MPCM_BROADCAST) arrives, the
+ * address frame itself is not stored in the input buffer.
+ * UART_MPCM_ALL receives all data frames (no filter).
+ */
+void uart_set_address(uint8_t addr);
+
+/*
+ * waits until all pending data was sent and sends 'addr' as address
+ * frame. data sent afterwards with the other functions only reaches the
+ * addressed node(s).
+ */
+void uart_send_address(uint8_t addr);
+#endif
+
+#if UART_STATS
+/*
+ * copies the statistics collected since start-up (or the last reset)
+ * to 'dest'. the high-water marks show how full the buffers got and
+ * help choosing RX_BUFFERSIZE/TX_BUFFERSIZE.
+ */
+void uart_get_stats(uart_stats_t *dest);
+
+/*
+ * sets all counters and high-water marks to zero
+ */
+void uart_reset_stats();
+#endif
+
+#if UART1_AVAILABLE
+/*
+ * the same functions for the second usart, see the descriptions above
+ */
+void uart1_init();
+uint8_t uart1_putc(char c);
+uint8_t uart1_puts(char *s);
+uint8_t uart1_write(const uint8_t *buf, uint8_t len);
+uint8_t uart1_write_nb(const uint8_t *buf, uint8_t len);
+uint8_t uart1_free_space();
+void uart1_flush();
+uint8_t uart1_puts_P(const char *s);
+uint8_t uart1_write_P(const uint8_t *buf, uint8_t len);
+#define uart1_puts_PSTR(s) uart1_puts_P(PSTR(s))
+uint8_t uart1_putb(char byte);
+#if UART_PRINTF
+uint8_t uart1_printf(const char *fmt, ...);
+uint8_t uart1_printf_P(const char *fmt, ...);
+#endif
+uint8_t uart1_getc(char *c);
+uint8_t uart1_available();
+uint8_t uart1_read(uint8_t *buf, uint8_t n);
+uint8_t uart1_read_until(char *buf, uint8_t size, char delim,
+        uint16_t timeout_ms);
+int16_t uart1_set_baud(uint32_t baud);
+uint32_t uart1_get_baud();
+#if UART_BAUD_NEGOTIATION
+uint32_t uart1_negotiate_baud(const uint32_t *rates, uint8_t count,
+        uint8_t max_error);
+uint32_t uart1_negotiate_answer(uint8_t max_error);
+#endif
+#if UART_LINE_DETECTION
+uint8_t uart1_lines_available();
+uint8_t uart1_read_line(char *buf, uint8_t size);
+#if UART_LINE_CALLBACK
+void uart1_set_line_callback(void (*callback)(void));
+#endif
+#endif
+#if UART1_MPCM
+void uart1_set_address(uint8_t addr);
+void uart1_send_address(uint8_t addr);
+#endif
+#if UART_STATS
+void uart1_get_stats(uart_stats_t *dest);
+void uart1_reset_stats();
+#endif
+#endif
+
 #endif
@@ -0,0 +1,4 @@
+/* second usart instance: compiles the driver with the uart1_* prefix,
+ * add this file to the sources when using the second usart */
+#define UART_INSTANCE 1
+#include "uart.c"
@@ -6,7 +6,7 @@ int main()
 	char c;
 
 	usi_uart_init();
-	usi_uart_sends("usi uart initialized\n");
+	usi_uart_sends_PSTR("usi uart initialized\n");
 
 	while (1) {
 		if (usi_uart_data_available()) {
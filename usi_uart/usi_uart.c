@@ -1,13 +1,82 @@
 #include <avr/io.h>
 #include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <util/delay.h>
+#include <util/atomic.h>
+#include <avr/eeprom.h>
+#include <string.h>
 
 #include "usi_uart.h"
+#include "../common/ringbuf.h"
+#include "../common/sleep_wait.h"
 
 
 #ifndef F_CPU
  #error "F_CPU is not defined."
 #endif
 
+#if TIMER1 && TIMER0_CTC
+ #error "Set only one of TIMER1 and TIMER0_CTC."
+#endif
+
+#if TIMER1
+#if TIMER1_PLL
+ #define TIMER1_CLOCK 64000000UL
+#else
+ #define TIMER1_CLOCK (F_CPU)
+#endif
+/* timer ticks per bit, rounded */
+#define TIMER1_PERIOD ((TIMER1_CLOCK/TIMER_PRESCALER + BAUDRATE/2) / BAUDRATE)
+/* ticks between the start bit edge and the timer being reset in the
+ * pin change interrupt */
+#define TIMER1_LATENCY ((16 * (TIMER1_CLOCK/(F_CPU))) / TIMER_PRESCALER)
+/* the compare match interrupts are in the middle of the bits, the
+ * first one samples the start bit */
+#define TIMER1_SAMPLE (TIMER1_PERIOD/2 - TIMER1_LATENCY)
+/* bits to wait for the next start bit after the stop bit */
+#define TIMER1_WAIT_NEXT 2
+
+#if TIMER1_PERIOD > 256 || TIMER1_PERIOD < 16
+ #error "Baudrate out of range for TIMER_PRESCALER with timer1."
+#elif TIMER1_PERIOD/2 <= TIMER1_LATENCY
+ #error "Baudrate too high for TIMER_PRESCALER with timer1."
+#endif
+/* the bit interrupt and the usi overflow interrupt within a bit time */
+#if (F_CPU)/BAUDRATE < 100
+ #error "Baudrate too high for timer1, use TIMER0_CTC."
+#endif
+#if TIMER1_CLOCK/TIMER_PRESCALER/TIMER1_PERIOD > BAUDRATE + BAUDRATE/50 || \
+	TIMER1_CLOCK/TIMER_PRESCALER/TIMER1_PERIOD < BAUDRATE - BAUDRATE/50
+ #warning "Baudrate error is more than 2%. Check baudrate/prescaler settings."
+#endif
+
+#elif TIMER0_CTC
+/* timer ticks per bit, rounded */
+#define TIMER0_PERIOD (((F_CPU)/TIMER_PRESCALER + BAUDRATE/2) / BAUDRATE)
+/* ticks between the start bit edge and the timer being set in the
+ * pin change interrupt */
+#define TIMER0_LATENCY (16/TIMER_PRESCALER)
+/* the first compare match has to be in the middle of the first data bit,
+ * 1.5 bits after the start bit edge. the counter starts above OCR0A,
+ * wraps at 0xff and then counts up to OCR0A. */
+#define TIMER0_INITIAL_SEED (256 - TIMER0_PERIOD/2 + TIMER0_LATENCY)
+/* the same timer waits for the next start bit after a received byte */
+#define TIMER0_WAIT_NEXT 0xff
+
+#if TIMER0_PERIOD > 256 || TIMER0_PERIOD < 16
+ #error "Baudrate out of range for TIMER_PRESCALER in CTC mode."
+#elif TIMER0_INITIAL_SEED > 255
+ #error "Baudrate too high for TIMER_PRESCALER in CTC mode, use TIMER_PRESCALER 1."
+#elif TIMER0_INITIAL_SEED <= TIMER0_PERIOD - 1
+ #error "Baudrate too low for TIMER_PRESCALER in CTC mode, use TIMER_PRESCALER 8."
+#endif
+/* the usart of the other side does not care about more than 2% */
+#if (F_CPU)/TIMER_PRESCALER/TIMER0_PERIOD > BAUDRATE + BAUDRATE/50 || \
+	(F_CPU)/TIMER_PRESCALER/TIMER0_PERIOD < BAUDRATE - BAUDRATE/50
+ #warning "Baudrate error is more than 2%. Check baudrate/prescaler settings."
+#endif
+
+#else
 #define TIMER0_SEED (256 - ((F_CPU/BAUDRATE)/TIMER_PRESCALER))
 #define TIMER0_INITIAL_SEED (256 - (((F_CPU)/BAUDRATE)/TIMER_PRESCALER) * 3/2)
 
@@ -17,10 +86,36 @@
 #if TIMER0_INITIAL_SEED<5
  #warning "TIMER0_INITIAL_SEED has critical value. Check baudrate/prescaler settings."
 #endif
+#endif
 
 #define USI_COUNTER_SEED_TX 11
+#if TIMER1
+/* one more shift, the start bit is sampled too */
+#define USI_COUNTER_SEED_RX 7
+#else
 #define USI_COUNTER_SEED_RX 8
+#endif
 
+#if TIMER1
+#if TIMER_PRESCALER == 1
+ #define TIMER1_CLOCK_SELECT (1<<CS10)
+#elif TIMER_PRESCALER == 2
+ #define TIMER1_CLOCK_SELECT (1<<CS11)
+#elif TIMER_PRESCALER == 4
+ #define TIMER1_CLOCK_SELECT ((1<<CS11) | (1<<CS10))
+#elif TIMER_PRESCALER == 8
+ #define TIMER1_CLOCK_SELECT (1<<CS12)
+#elif TIMER_PRESCALER == 16
+ #define TIMER1_CLOCK_SELECT ((1<<CS12) | (1<<CS10))
+#elif TIMER_PRESCALER == 32
+ #define TIMER1_CLOCK_SELECT ((1<<CS12) | (1<<CS11))
+#elif TIMER_PRESCALER == 64
+ #define TIMER1_CLOCK_SELECT ((1<<CS12) | (1<<CS11) | (1<<CS10))
+#else
+ #error "Unsupported TIMER_PRESCALER value."
+#endif
+#define TIMER_STOP() TCCR1 = 0
+#else
 #if TIMER_PRESCALER == 1
  #define TIMER0_CLOCK_SELECT (1<<CS00)
 #elif TIMER_PRESCALER == 8
@@ -28,34 +123,164 @@
 #else
  #error "Unsupported TIMER_PRESCALER value."
 #endif
+#define TIMER_STOP() TCCR0B = 0
+#endif
 
 
 #define RX_BUFFER_MASK (USI_UART_RX_BUFFER_SIZE-1)
 #define TX_BUFFER_MASK (USI_UART_TX_BUFFER_SIZE-1)
 
-static unsigned char rx_buffer[USI_UART_RX_BUFFER_SIZE];
-static volatile uint8_t rx_head;
-static volatile uint8_t rx_tail;
+RINGBUF_CHECK_SIZE(USI_UART_RX_BUFFER_SIZE, USI_UART_RX_BUFFER_SIZE);
+RINGBUF_CHECK_SIZE(USI_UART_TX_BUFFER_SIZE, USI_UART_TX_BUFFER_SIZE);
 
-static unsigned char tx_buffer[USI_UART_TX_BUFFER_SIZE];
-static volatile uint8_t tx_head;
-static volatile uint8_t tx_tail;
+static uint8_t rx_buffer[USI_UART_RX_BUFFER_SIZE];
+static ringbuf_t rx_ring;
 
-static volatile uint8_t tx_current_byte;
+static uint8_t tx_buffer[USI_UART_TX_BUFFER_SIZE];
+static ringbuf_t tx_ring;
 
+static volatile uint8_t tx_current_byte;
+static uint8_t rx_current_byte;
+
+/*
+ * State machine, T is one bit time:
+ *
+ * IDLE         pin change interrupt on DI enabled, timer stopped.
+ *              falling edge -> RX_ACTIVE. sendc() -> TX_ACTIVE.
+ * RX_ACTIVE    the usi samples 8 data bits, the first one 1.5T after
+ *              the start bit edge (timer1: the start bit at 0.5T too).
+ *              usi overflow in the middle of bit 7 -> RX_STOP_BIT.
+ * RX_STOP_BIT  usi stopped, the next bit timer interrupt (middle of the
+ *              stop bit) stores or discards the byte -> RX_WAIT_NEXT.
+ * RX_WAIT_NEXT pin change enabled again, the timer runs 256 ticks
+ *              (timer1: 2T). falling edge -> RX_ACTIVE, timeout ->
+ *              TX_ACTIVE if there is data to send, IDLE otherwise.
+ *              this is the turnaround: the other side has this long to
+ *              start its next byte before we may use the line.
+ * TX_ACTIVE    usi overflow: load the start bit and the first data
+ *              bits of the next byte -> TX_MID_BYTE, or -> IDLE if the
+ *              tx buffer is empty. the first overflow after starting
+ *              comes T after sendc().
+ * TX_MID_BYTE  usi overflow: load the remaining data bits and the stop
+ *              bit -> TX_ACTIVE.
+ * CAL_START,   usi_uart_calibrate() only, the pin change interrupt
+ * CAL_ACTIVE   measures edge distances.
+ *
+ * The usi overflow interrupt must run within T after the shift that
+ * triggered it (TX: before the next shift, RX: before the stop bit
+ * sample), the pin change interrupt within about T/2.
+ */
 #define STATE_IDLE			0
 #define STATE_RX_ACTIVE		1
 #define STATE_RX_WAIT_NEXT	2
 #define STATE_TX_ACTIVE		3
 #define STATE_TX_MID_BYTE	4
+#define STATE_RX_STOP_BIT	5
+#define STATE_CAL_START		6
+#define STATE_CAL_ACTIVE	7
 static volatile uint8_t state;
 
+#if USI_UART_STATS
+static usi_uart_stats_t stats;
+
+#define STATS_INC(field) stats.field++
+#define STATS_LEVEL(field, level) \
+	do { uint8_t l_ = (level); if (l_ > stats.field) stats.field = l_; } while (0)
+#else
+#define STATS_INC(field)
+#define STATS_LEVEL(field, level)
+#endif
+
+#if TIMER1
+static volatile uint8_t wait_next;
+#endif
+
+#if RX_CALLBACK
+static void (*volatile rx_callback)(char c);
+
+/* bit reversed constant, as the byte is in the rx buffer */
+#define REVERSE_CONST(b) ((((b) & 0x01) << 7) | (((b) & 0x02) << 5) | \
+		(((b) & 0x04) << 3) | (((b) & 0x08) << 1) | (((b) & 0x10) >> 1) | \
+		(((b) & 0x20) >> 3) | (((b) & 0x40) >> 5) | (((b) & 0x80) >> 7))
+#endif
+
+/* blocking functions wait for space/data in the buffers like this */
+#if SLEEP_WHILE_BLOCKED
+ #define WAIT_WHILE(cond) SLEEP_WAIT_WHILE(cond)
+#else
+ #define WAIT_WHILE(cond) while (cond) ;
+#endif
+
+/* reverse the bit order in given byte, data is transmitted lsb first */
+#if REVERSE_TABLE == 2
+#define R2(n) (n), (n) + 2*64, (n) + 1*64, (n) + 3*64
+#define R4(n) R2(n), R2((n) + 2*16), R2((n) + 1*16), R2((n) + 3*16)
+#define R6(n) R4(n), R4((n) + 2*4), R4((n) + 1*4), R4((n) + 3*4)
+static const uint8_t reverse_table[256] PROGMEM = {
+	R6(0), R6(2), R6(1), R6(3)
+};
+
+static inline uint8_t
+reverse_byte(uint8_t byte)
+{
+	return pgm_read_byte(&reverse_table[byte]);
+}
+
+#elif REVERSE_TABLE == 1
+static const uint8_t reverse_nibble[16] PROGMEM = {
+	0x0, 0x8, 0x4, 0xc, 0x2, 0xa, 0x6, 0xe,
+	0x1, 0x9, 0x5, 0xd, 0x3, 0xb, 0x7, 0xf
+};
+
+static inline uint8_t
+reverse_byte(uint8_t byte)
+{
+	return (pgm_read_byte(&reverse_nibble[byte & 0x0f]) << 4) |
+		pgm_read_byte(&reverse_nibble[byte >> 4]);
+}
+
+#else
+static uint8_t
+reverse_byte(uint8_t byte)
+{
+	byte = ((byte >> 1) & 0x55) | ((byte << 1) & 0xaa);
+	byte = ((byte >> 2) & 0x33) | ((byte << 2) & 0xcc);
+	byte = ((byte >> 4) & 0x0f) | ((byte << 4) & 0xf0);
+	return byte;
+}
+#endif
+
 
 static void
 initialize_transmitter()
 {
 	cli();
 
+#if TIMER1
+	/* setup timer1 to generate a compare match interrupt every time
+	 * the usi should shift out the next bit */
+	TCNT1 = 0;
+	OCR1C = TIMER1_PERIOD - 1;
+	OCR1A = TIMER1_PERIOD - 1;
+	TCCR1 = (1<<CTC1) | TIMER1_CLOCK_SELECT;
+	TIFR = (1<<OCF1A);
+	TIMSK |= (1<<OCIE1A);
+
+	/* enable usi overflow interrupt, three wire mode */
+	USICR = (1<<USIOIE) | (1<<USIWM0);
+#elif TIMER0_CTC
+	/* setup timer0 to generate a compare match every time the usi
+	 * should shift out the next bit */
+	TCNT0 = 0;
+	OCR0A = TIMER0_PERIOD - 1;
+	TCCR0A = (1<<WGM01);
+	TCCR0B = TIMER0_CLOCK_SELECT;
+	TIMSK &= ~(1<<OCIE0A);
+
+	/* enable usi overflow interrupt, three wire mode,
+	 * clocked by timer0 compare match */
+	USICR = (1<<USIOIE) | (1<<USIWM0) | (1<<USICS0);
+#else
 	/* setup timer0 to generate an overflow interrupt every time
 	 * the usi should shift out the next bit */
 	TCNT0 = TIMER0_SEED;
@@ -65,6 +290,7 @@ initialize_transmitter()
 
 	/* enable usi overflow interrupt, three wire mode */
 	USICR = (1<<USIOIE) | (1<<USIWM0);
+#endif
 	/* load high bits into the shift register */
 	USIDR = 0xff;
 	/* clear usi interrupt flags */
@@ -103,9 +329,109 @@ initialize_receiver()
 	sei();
 }
 
+#if CALIBRATION
+/* the falling edges of 0x55 (start bit, bits 1, 3, 5, 7) are two bits
+ * apart. the calibration timer runs free with a prescaler that fits
+ * two bits (+25%) into eight bits. */
+#if TIMER1
+ #define CAL_CLOCK TIMER1_CLOCK
+#else
+ #define CAL_CLOCK (F_CPU)
+#endif
+#if 5*(CAL_CLOCK/2)/BAUDRATE < 256
+ #define CAL_PRESCALER 1
+#elif 5*(CAL_CLOCK/2)/BAUDRATE/8 < 256
+ #define CAL_PRESCALER 8
+#else
+ #define CAL_PRESCALER 64
+#endif
+#if TIMER1
+ #define CAL_TCNT TCNT1
+ #define CAL_OVERFLOW_ENABLE (1<<TOIE1)
+ #define CAL_OVERFLOW_FLAG (1<<TOV1)
+ #if CAL_PRESCALER == 1
+  #define CAL_TIMER_START() TCCR1 = (1<<CS10)
+ #elif CAL_PRESCALER == 8
+  #define CAL_TIMER_START() TCCR1 = (1<<CS12)
+ #else
+  #define CAL_TIMER_START() TCCR1 = (1<<CS12) | (1<<CS11) | (1<<CS10)
+ #endif
+#else
+ #define CAL_TCNT TCNT0
+ #define CAL_OVERFLOW_ENABLE (1<<TOIE0)
+ #define CAL_OVERFLOW_FLAG (1<<TOV0)
+ #if CAL_PRESCALER == 1
+  #define CAL_TIMER_START() do { TCCR0A = 0; TCCR0B = (1<<CS00); } while (0)
+ #elif CAL_PRESCALER == 8
+  #define CAL_TIMER_START() do { TCCR0A = 0; TCCR0B = (1<<CS01); } while (0)
+ #else
+  #define CAL_TIMER_START() do { TCCR0A = 0; TCCR0B = (1<<CS01) | (1<<CS00); } while (0)
+ #endif
+#endif
+
+/* edge distances per measurement */
+#define CAL_INTERVALS 32
+/* expected sum of all distances */
+#define CAL_EXPECTED ((2UL*CAL_INTERVALS*CAL_CLOCK/CAL_PRESCALER + BAUDRATE/2) / BAUDRATE)
+/* expected distance of two edges, anything more than 25% off is
+ * not part of a sync byte */
+#define CAL_DISTANCE (CAL_EXPECTED/CAL_INTERVALS)
+#define CAL_DISTANCE_MIN (CAL_DISTANCE - CAL_DISTANCE/4)
+#define CAL_DISTANCE_MAX (CAL_DISTANCE + CAL_DISTANCE/4)
+
+#if CAL_DISTANCE_MAX > 255
+ #error "Baudrate too low for calibration."
+#elif CAL_DISTANCE < 16
+ #error "Baudrate too high for calibration."
+#endif
+
+static uint8_t cal_last;
+static volatile uint8_t cal_count;
+static volatile uint16_t cal_sum;
+/* overflows of the calibration timer since the last edge */
+static volatile uint8_t cal_overflows;
+
+/* falling edge while calibrating, sums up the edge distances */
+static inline void
+calibration_edge()
+{
+	uint8_t now = CAL_TCNT, d, wrapped;
+
+	if (PINB & (1<<PB0))
+		return;
+
+	/* eight bits only show the distance modulo 256, a long idle gap
+	 * could look like two bits. the timer wrapped if it counted an
+	 * overflow or is below the last value (the overflow interrupt may
+	 * still be pending), such a distance is not used. */
+	d = now - cal_last;
+	wrapped = cal_overflows != 0 || now < cal_last;
+	cal_last = now;
+	cal_overflows = 0;
+
+	if (state == STATE_CAL_START) {
+		/* first edge, no reference yet */
+		state = STATE_CAL_ACTIVE;
+		return;
+	}
+
+	if (!wrapped && cal_count < CAL_INTERVALS &&
+			d >= CAL_DISTANCE_MIN && d <= CAL_DISTANCE_MAX) {
+		cal_sum += d;
+		cal_count++;
+	}
+}
+#endif
+
 /* pin change interrupt - detect the falling edge of the start bit */
 ISR(PCINT0_vect)
 {
+#if CALIBRATION
+	if (state >= STATE_CAL_START) {
+		calibration_edge();
+		return;
+	}
+#endif
 
 	if (PINB & (1<<PB0)) {
 		/* di is high, this was the transition
@@ -113,6 +439,31 @@ ISR(PCINT0_vect)
 		return;
 	}
 
+#if TIMER1
+	/* first compare match in the middle of the start bit */
+	TCNT1 = 0;
+	OCR1C = TIMER1_PERIOD - 1;
+	OCR1A = TIMER1_SAMPLE;
+	TCCR1 = (1<<CTC1) | TIMER1_CLOCK_SELECT;
+	TIFR = (1<<OCF1A);
+	TIMSK |= (1<<OCIE1A);
+
+	/* enable usi overflow interrupt, three wire mode, no clock source */
+	USICR = (1<<USIOIE) | (1<<USIWM0);
+#elif TIMER0_CTC
+	/* initial timer seed, first compare match after 1.5 bits */
+	TCNT0 = TIMER0_INITIAL_SEED;
+	OCR0A = TIMER0_PERIOD - 1;
+	TCCR0A = (1<<WGM01);
+	/* start timer0 */
+	TCCR0B = TIMER0_CLOCK_SELECT;
+	/* no timer interrupts while the usi shifts */
+	TIMSK &= ~(1<<OCIE0A);
+
+	/* enable usi overflow interrupt, three wire mode,
+	 * clocked by timer0 compare match */
+	USICR = (1<<USIOIE) | (1<<USIWM0) | (1<<USICS0);
+#else
 	/* initial timer seed */
 	TCNT0 = TIMER0_INITIAL_SEED + 2;
 	/* start timer0 */
@@ -124,6 +475,7 @@ ISR(PCINT0_vect)
 
 	/* enable usi overflow interrupt, three wire mode, no clock source */
 	USICR = (1<<USIOIE) | (1<<USIWM0);
+#endif
 	/* clear interrupt flags, set usi counter value */
 	USISR = (1<<USISIF) | (1<<USIOIF) | (1<<USIPF) | USI_COUNTER_SEED_RX;
 
@@ -136,33 +488,28 @@ ISR(PCINT0_vect)
 /* usi shift counter overflow interrupt */
 ISR(USI_OVF_vect)
 {
-	uint8_t new_tail;
+	uint8_t c;
 
 	switch (state) {
 		case STATE_RX_ACTIVE:
 			/* at this point the eight data bits of the uart frame
 			 * should be in the usi data register */
-
-			new_tail = (rx_tail+1) & RX_BUFFER_MASK;
-			if (new_tail != rx_head) {
-				/* store received byte */
-				rx_buffer[rx_tail] = USIDR;
-				rx_tail = new_tail;
-			} else {
-				/* rx buffer is full, discard for now */
-			}
-
-			/* get ready for next start condition */
-			TCNT0 = 0;
-			initialize_receiver();
-			state = STATE_RX_WAIT_NEXT;
+			rx_current_byte = USIDR;
+
+			/* stop the usi, the next timer interrupt comes in the
+			 * middle of the stop bit */
+			USICR = 0;
+#if TIMER0_CTC
+			TIFR = (1<<OCF0A);
+			TIMSK |= (1<<OCIE0A);
+#endif
+			state = STATE_RX_STOP_BIT;
 			break;
 
 		case STATE_TX_ACTIVE:
 			/* transmit the next byte from the tx buffer */
-			if (tx_head != tx_tail) {
-				tx_current_byte = tx_buffer[tx_head];
-				tx_head = (tx_head+1) & TX_BUFFER_MASK;
+			if (ringbuf_get(&tx_ring, tx_buffer, TX_BUFFER_MASK, &c) == 0) {
+				tx_current_byte = c;
 
 				/* clear usi interrupt flags, set usi counter */
 				USISR = (1<<USISIF) | (1<<USIOIF) | (1<<USIPF) | USI_COUNTER_SEED_TX;
@@ -173,8 +520,8 @@ ISR(USI_OVF_vect)
 				state = STATE_TX_MID_BYTE;
 
 			} else {
-				/* tx buffer empty, disable timer0, get ready to receive */
-				TCCR0B = 0;
+				/* tx buffer empty, disable timer, get ready to receive */
+				TIMER_STOP();
 				initialize_receiver();
 			}
 			break;
@@ -191,21 +538,117 @@ ISR(USI_OVF_vect)
 	}
 }
 
+/* called in the middle of the stop bit of a received byte */
+static inline void
+rx_stop_bit()
+{
+#if RX_CALLBACK
+	void (*callback)(char c) = NULL;
+	uint8_t c = rx_current_byte;
+#endif
+
+	if (!(PINB & (1<<PB0))) {
+		/* framing error, the byte is most likely garbage */
+		STATS_INC(frame_errors);
+	} else if (ringbuf_put(&rx_ring, rx_buffer, RX_BUFFER_MASK, rx_current_byte) != 0) {
+		/* rx buffer is full, the byte is lost */
+		STATS_INC(overruns);
+	} else {
+		STATS_INC(rx_bytes);
+		STATS_LEVEL(rx_high_water, ringbuf_used(&rx_ring, RX_BUFFER_MASK));
+#if RX_CALLBACK
+ #if RX_CALLBACK_DELIMITER < 0
+		callback = rx_callback;
+ #else
+		if (c == REVERSE_CONST((uint8_t)RX_CALLBACK_DELIMITER))
+			callback = rx_callback;
+ #endif
+#endif
+	}
+
+	/* get ready for next start condition */
+#if TIMER1
+	/* the bit interrupt keeps running and counts down */
+	wait_next = TIMER1_WAIT_NEXT;
+#elif TIMER0_CTC
+	/* wait for it with the compare match interrupt */
+	TCNT0 = 0;
+	OCR0A = TIMER0_WAIT_NEXT;
+#else
+	TCNT0 = 0;
+#endif
+	initialize_receiver();
+	state = STATE_RX_WAIT_NEXT;
+
+#if RX_CALLBACK
+	/* the receiver is ready for the next start bit first */
+	if (callback)
+		callback(reverse_byte(c));
+#endif
+}
+
+/* after receiving the last frame we waited some time to see if
+ * the opposite side wanted to send more but did not detect a new
+ * start condition */
+static inline void
+rx_wait_next_done()
+{
+	if (!ringbuf_empty(&tx_ring)) {
+		/* there is data in the tx buffer, start transmitting */
+		initialize_transmitter();
+	} else {
+		/* nothing to do for now */
+		TIMER_STOP();
+		state = STATE_IDLE;
+	}
+}
+
+#if TIMER1
+/* timer1 compare match interrupt - timing for the usi */
+ISR(TIM1_COMPA_vect)
+{
+	if (state == STATE_RX_WAIT_NEXT) {
+		if (--wait_next == 0)
+			rx_wait_next_done();
+	} else if (state == STATE_RX_STOP_BIT) {
+		rx_stop_bit();
+	} else {
+		/* usi clock strobe, shift data in/out */
+		USICR |= (1<<USICLK);
+	}
+}
+#elif TIMER0_CTC
+/* timer0 compare match interrupt - only used for the stop bit and
+ * while waiting for the next start bit, the usi shifts on compare
+ * match by itself */
+ISR(TIM0_COMPA_vect)
+{
+	if (state == STATE_RX_STOP_BIT) {
+		rx_stop_bit();
+		return;
+	}
+
+	TIMSK &= ~(1<<OCIE0A);
+
+	if (state == STATE_RX_WAIT_NEXT)
+		rx_wait_next_done();
+}
+#else
 /* timer0 overflow interrupt - timing for the usi */
 ISR(TIM0_OVF_vect)
 {
+#if CALIBRATION
+	if (state >= STATE_CAL_START) {
+		/* the calibration timer wrapped */
+		cal_overflows++;
+		return;
+	}
+#endif
+
 	if (state == STATE_RX_WAIT_NEXT) {
-		/* after receiving the last frame we waited some time
-		 * to see if the opposite side wanted to send more but
-		 * did not detect a new start condition */
-		if (tx_head != tx_tail) {
-			/* there is data in the tx buffer, start transmitting */
-			initialize_transmitter();
-		} else {
-			/* nothing to do for now */
-			TCCR0B = 0;
-			state = STATE_IDLE;
-		}
+		rx_wait_next_done();
+	} else if (state == STATE_RX_STOP_BIT) {
+		rx_stop_bit();
 	} else {
 		/* time until next interrupt */
 		TCNT0 += TIMER0_SEED;
@@ -213,16 +656,21 @@ ISR(TIM0_OVF_vect)
 		USICR |= (1<<USICLK);
 	}
 }
+#endif
 
-/* reverse the bit order in given byte, data is transmitted lsb first */
-static uint8_t
-reverse_byte(uint8_t byte)
+#if CALIBRATION && TIMER1
+/* timer1 overflow interrupt - the calibration timer wrapped */
+ISR(TIM1_OVF_vect)
 {
-	byte = ((byte >> 1) & 0x55) | ((byte << 1) & 0xaa);
-	byte = ((byte >> 2) & 0x33) | ((byte << 2) & 0xcc);
-	byte = ((byte >> 4) & 0x0f) | ((byte << 4) & 0xf0);
-	return byte;
+	cal_overflows++;
 }
+#elif CALIBRATION && TIMER0_CTC
+/* timer0 overflow interrupt - the calibration timer wrapped */
+ISR(TIM0_OVF_vect)
+{
+	cal_overflows++;
+}
+#endif
 
 void
 usi_uart_init()
@@ -232,29 +680,34 @@ usi_uart_init()
 	/* configure usi di/do as input */
 	DDRB &= ~((1<<PB1) | (1<<PB0));
 
+#if TIMER1 && TIMER1_PLL
+	/* start the pll and clock timer1 from it once it is locked */
+	PLLCSR |= (1<<PLLE);
+	_delay_us(100);
+	while (!(PLLCSR & (1<<PLOCK)))
+		;
+	PLLCSR |= (1<<PCKE);
+#endif
+
 	initialize_receiver();
 }
 
 uint8_t
 usi_uart_sendc(char c)
 {
-	uint8_t next_tail;
-
-	next_tail = (tx_tail+1) & TX_BUFFER_MASK;
+	/* write byte to tx buffer, lsb first */
+	c = reverse_byte(c);
 #if BLOCKING_WRITE
-	while (next_tail == tx_head)
-		; /* wait for space */
+	/* wait for space */
+	WAIT_WHILE(ringbuf_free(&tx_ring, TX_BUFFER_MASK) == 0);
+	ringbuf_put(&tx_ring, tx_buffer, TX_BUFFER_MASK, c);
 #else
-	if (next_tail == tx_head) {
+	if (ringbuf_put(&tx_ring, tx_buffer, TX_BUFFER_MASK, c) != 0) {
 		/* return unsuccessfully */
 		return 1;
 	}
 #endif
 
-	/* write byte to tx buffer, lsb first */
-	tx_buffer[tx_tail] = reverse_byte(c);
-	tx_tail = next_tail;
-
 	if (state == STATE_IDLE) {
 		initialize_transmitter();
 	}
@@ -274,60 +727,294 @@ usi_uart_sends(const char *s)
 	return count;
 }
 
+uint8_t
+usi_uart_sends_P(const char *s)
+{
+	uint8_t count = 0;
+	char c;
+
+	while ((c = pgm_read_byte(s++)) && usi_uart_sendc(c) == 0) {
+		count++;
+	}
+
+	return count;
+}
+
+uint8_t
+usi_uart_sendn_P(const uint8_t *buf, uint8_t n)
+{
+	uint8_t count = 0;
+
+	while (count < n && usi_uart_sendc(pgm_read_byte(buf++)) == 0) {
+		count++;
+	}
+
+	return count;
+}
+
 uint8_t
 usi_uart_data_available()
 {
-	uint8_t tail = rx_tail; /* read once */
-	return tail >= rx_head ? tail-rx_head : USI_UART_RX_BUFFER_SIZE-rx_head+tail;
+	return ringbuf_used(&rx_ring, RX_BUFFER_MASK);
 }
 
 uint8_t
 usi_uart_recvc(char *c)
 {
-	if (rx_head == rx_tail) {
+	uint8_t b;
+
+	if (ringbuf_get(&rx_ring, rx_buffer, RX_BUFFER_MASK, &b) != 0) {
 		/* no data in rx buffer */
 		return 1;
 	}
 
-	*c = reverse_byte(rx_buffer[rx_head]);
-	rx_head = (rx_head+1) & RX_BUFFER_MASK;
-
+	*c = reverse_byte(b);
 	return 0;
 }
 
 uint8_t
 usi_uart_recvn(char *buf, uint8_t n)
 {
-	uint8_t c = 0;
-
-	while (rx_head != rx_tail && c++ < n) {
-		*buf++ = reverse_byte(rx_buffer[rx_head]);
-		rx_head = (rx_head+1) & RX_BUFFER_MASK;
+	uint8_t i, seg, c = 0;
+
+	/* copy contiguous segments, release each one as a whole */
+	while (c < n && (seg = ringbuf_read_peek(&rx_ring, RX_BUFFER_MASK)) != 0) {
+		if (seg > n-c)
+			seg = n-c;
+		for (i = 0; i < seg; i++)
+			buf[c+i] = reverse_byte(rx_buffer[rx_ring.head+i]);
+		ringbuf_read_commit(&rx_ring, RX_BUFFER_MASK, seg);
+		c += seg;
 	}
 
 	return c;
 }
 
+/* waits until the input buffer is not empty, at most 'timeout_ms'
+ * milliseconds (0: wait forever). returns 1 on timeout */
+static uint8_t
+rx_wait(uint16_t timeout_ms)
+{
+#ifdef USI_UART_TICKS
+	uint16_t start;
+#else
+	uint8_t ticks = 0;
+#endif
+
+	if (timeout_ms == 0) {
+		WAIT_WHILE(ringbuf_empty(&rx_ring));
+		return 0;
+	}
+
+#ifdef USI_UART_TICKS
+	/* the interrupt of the tick source wakes us up */
+	start = USI_UART_TICKS();
+	WAIT_WHILE(ringbuf_empty(&rx_ring) &&
+			(uint16_t)(USI_UART_TICKS() - start) < timeout_ms);
+
+	return ringbuf_empty(&rx_ring);
+#else
+	while (ringbuf_empty(&rx_ring)) {
+		_delay_us(100);
+		if (++ticks == 10) {
+			ticks = 0;
+			if (--timeout_ms == 0)
+				return 1;
+		}
+	}
+
+	return 0;
+#endif
+}
+
+uint8_t
+usi_uart_recvc_timeout(char *c, uint16_t timeout_ms)
+{
+	if (rx_wait(timeout_ms) != 0)
+		return 1;
+
+	return usi_uart_recvc(c);
+}
+
 uint8_t
 usi_uart_recv_until(char *buf, uint8_t size, char delimiter)
 {
-	uint8_t c = 0;
+	return usi_uart_recv_until_timeout(buf, size, delimiter, 0);
+}
 
-	while (c++ < size) {
-		while (rx_head == rx_tail) ;
+uint8_t
+usi_uart_recv_until_timeout(char *buf, uint8_t size, char delimiter,
+		uint16_t timeout_ms)
+{
+	uint8_t c = 0;
 
-		*buf = reverse_byte(rx_buffer[rx_head]);
-		rx_head = (rx_head+1) & RX_BUFFER_MASK;
+	while (c < size) {
+		if (rx_wait(timeout_ms) != 0)
+			break;
 
-		if (*buf == delimiter) break;
-		buf++;
+		usi_uart_recvc(&buf[c]);
+		if (buf[c++] == delimiter)
+			break;
 	}
 
 	return c;
 }
 
+void
+usi_uart_flush()
+{
+	/* the last usi overflow of a transmission comes after its stop bit */
+	WAIT_WHILE(!ringbuf_empty(&tx_ring) || state == STATE_TX_ACTIVE ||
+			state == STATE_TX_MID_BYTE);
+}
+
 void
 usi_uart_rx_buffer_clear()
 {
-	rx_head = rx_tail = 0;
+	/* only the consumer side index is touched, the isr owns the tail */
+	rx_ring.head = rx_ring.tail;
 }
+
+#if RX_CALLBACK
+void
+usi_uart_set_rx_callback(void (*callback)(char c))
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		rx_callback = callback;
+	}
+}
+#endif
+
+#if CALIBRATION
+/* sums up CAL_INTERVALS edge distances, returns non-zero on timeout */
+static uint8_t
+calibration_measure(uint16_t *sum)
+{
+	uint16_t ms = CALIBRATION_TIMEOUT;
+
+	cli();
+	cal_count = 0;
+	cal_sum = 0;
+	state = STATE_CAL_START;
+	sei();
+
+	while (cal_count < CAL_INTERVALS) {
+		if (ms-- == 0)
+			return 1;
+		_delay_ms(1);
+	}
+
+	cli();
+	*sum = cal_sum;
+	sei();
+
+	return 0;
+}
+
+uint8_t
+usi_uart_calibrate()
+{
+	uint16_t sum, err, best_err = 0xffff;
+	uint8_t i, best = OSCCAL, ret = 0;
+
+	/* wait for the end of the current transfer */
+	WAIT_WHILE(state != STATE_IDLE);
+
+	cli();
+	/* no bit timing interrupts, they would touch the timer */
+#if TIMER1
+	TIMSK &= ~(1<<OCIE1A);
+#else
+	TIMSK &= ~((1<<TOIE0) | (1<<OCIE0A));
+#endif
+	CAL_TIMER_START();
+	TIFR = CAL_OVERFLOW_FLAG;
+	TIMSK |= CAL_OVERFLOW_ENABLE;
+	initialize_receiver();
+
+	/* OSCCAL steps are below 1%, 64 steps cover any sane drift. the
+	 * oscillator range (bit 7) is kept, the ranges overlap. */
+	for (i = 0; i < 64; i++) {
+		if (calibration_measure(&sum) != 0) {
+			ret = 1;
+			break;
+		}
+
+		err = sum > CAL_EXPECTED ? sum - CAL_EXPECTED : CAL_EXPECTED - sum;
+		if (err < best_err) {
+			best_err = err;
+			best = OSCCAL;
+		}
+
+		/* within 0.5% */
+		if (err <= CAL_EXPECTED/200)
+			break;
+
+		/* more ticks than expected: the clock is too fast */
+		if (sum > CAL_EXPECTED) {
+			if ((OSCCAL & 0x7f) == 0)
+				break;
+			OSCCAL--;
+		} else {
+			if ((OSCCAL & 0x7f) == 0x7f)
+				break;
+			OSCCAL++;
+		}
+	}
+
+	OSCCAL = best;
+
+	cli();
+	TIMER_STOP();
+	TIMSK &= ~CAL_OVERFLOW_ENABLE;
+	initialize_receiver();
+
+	/* sendc() does not start the transmitter while calibrating, eg
+	 * for a byte from an interrupt */
+	if (!ringbuf_empty(&tx_ring))
+		initialize_transmitter();
+
+	if (best_err > CAL_EXPECTED/50)
+		ret = 1;
+
+#if CALIBRATION_EEPROM
+	if (ret == 0)
+		eeprom_update_byte(CALIBRATION_EEPROM_ADDR, best);
+#endif
+
+	return ret;
+}
+
+#if CALIBRATION_EEPROM
+uint8_t
+usi_uart_calibration_load()
+{
+	uint8_t cal = eeprom_read_byte(CALIBRATION_EEPROM_ADDR);
+
+	/* erased eeprom */
+	if (cal == 0xff)
+		return 1;
+
+	OSCCAL = cal;
+	return 0;
+}
+#endif
+#endif
+
+#if USI_UART_STATS
+void
+usi_uart_get_stats(usi_uart_stats_t *dest)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		memcpy(dest, &stats, sizeof(stats));
+	}
+}
+
+void
+usi_uart_reset_stats()
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		memset(&stats, 0, sizeof(stats));
+	}
+}
+#endif
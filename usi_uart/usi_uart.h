@@ -13,6 +13,7 @@
 #define USI_UART_H
 
 #include <stdint.h>
+#include <avr/pgmspace.h>
 
 /*
  * Possible baudrates depend on the system clock speed,
@@ -27,17 +28,150 @@
  *
  * F_CPU needs to be set accordingly.
  */
+#ifndef BAUDRATE
 #define BAUDRATE 19200
+#endif
+#ifndef TIMER_PRESCALER
 #define TIMER_PRESCALER 8
+#endif
+
+/* If set to 1, timer0 runs in clear timer on compare match (CTC) mode
+ * and the usi is clocked directly by the compare match: the hardware
+ * restarts the counter and shifts the bits, there are no timer
+ * interrupts and no jitter while a byte is transferred.
+ *
+ * This allows 38400 baud (TIMER_PRESCALER 8) and 57600 baud
+ * (TIMER_PRESCALER 1) at 8MHz. Timer0 and OCR0A are used exclusively.
+ *
+ * The pin change interrupt (start bit) and the compare match interrupt
+ * (stop bit) are still timed by software. For bytes back to back with
+ * 2% baudrate difference other interrupts may delay them by about 20
+ * cycles at 38400 baud and 10 cycles at 57600 baud, see the ctc runs of
+ * tests/usi_uart_bench.c.
+ */
+#ifndef TIMER0_CTC
+#define TIMER0_CTC 0
+#endif
+
+/* If set to 1, timer1 times the bits instead of timer0, which is left
+ * free for the application. Timer1 runs in CTC mode (OCR1C) and calls
+ * an interrupt for every bit. TIMER_PRESCALER may be 1, 2, 4, ... 64.
+ *
+ * With TIMER1_PLL set to 1 timer1 is clocked from the 64MHz pll
+ * instead of the system clock, eg 57600 baud with TIMER_PRESCALER 8.
+ *
+ * The bit interrupt and the usi overflow interrupt have to fit into
+ * a bit time: at 8MHz the host bench (tests/usi_uart_bench.c) decodes
+ * up to 76800 baud with 2% baudrate difference, but only if other
+ * interrupts never delay them. Less than 100 cycles per bit are
+ * rejected, use TIMER0_CTC above that, the usi shifts by hardware.
+ */
+#ifndef TIMER1
+#define TIMER1 0
+#endif
+#ifndef TIMER1_PLL
+#define TIMER1_PLL 0
+#endif
 
 /* If set to 1, the sendc/sends function will not return
  * until all data was written to the output buffer.
  */
+#ifndef BLOCKING_WRITE
 #define BLOCKING_WRITE 1
+#endif
+
+/* If set to 1, blocking functions put the cpu into idle sleep mode
+ * until the next interrupt instead of busy waiting.
+ */
+#ifndef SLEEP_WHILE_BLOCKED
+#define SLEEP_WHILE_BLOCKED 0
+#endif
+
+/* Every byte is sent/received msb first by the usi and has its bits
+ * reversed on the way through the buffers:
+ * 0: shifting and masking, no table
+ * 1: 16 byte nibble table in flash, two lookups
+ * 2: 256 byte table in flash, a single lookup
+ * It runs in sendc/recvc and for the rx callback, never while the usi
+ * shifts. Estimated cost per byte (tests/usi_uart_bench.c): 0 about 15
+ * cycles, 1 about 20 (two flash reads, not faster), 2 about 7. That is
+ * below 0.5% of a byte time at 19200 baud, the tables rarely pay off.
+ */
+#ifndef REVERSE_TABLE
+#define REVERSE_TABLE 0
+#endif
+
+/* If set to 1, usi_uart_set_rx_callback() installs a function that
+ * is called from the receive interrupt, after the byte was stored in
+ * the input buffer. With RX_CALLBACK_DELIMITER set to -1 it is called
+ * for every byte, otherwise only when this byte was received (eg to
+ * wake up the main loop when a full command arrived). The receiver is
+ * ready for the next byte and interrupts are enabled when it is called,
+ * the function may take up to a byte time, otherwise the next call
+ * interrupts it.
+ */
+#ifndef RX_CALLBACK
+#define RX_CALLBACK 0
+#endif
+#ifndef RX_CALLBACK_DELIMITER
+#define RX_CALLBACK_DELIMITER '\n'
+#endif
+
+/* Tick source for the receive timeouts: an expression that returns a
+ * free running millisecond counter (uint16_t), eg updated by a timer
+ * interrupt of the application. The functions with a timeout then
+ * sleep while waiting (with SLEEP_WHILE_BLOCKED), otherwise they poll
+ * in steps of 100us.
+ */
+/* #define USI_UART_TICKS() millis() */
 
 /* buffer sizes must be a power of 2 */
+#ifndef USI_UART_RX_BUFFER_SIZE
 #define USI_UART_RX_BUFFER_SIZE 16
+#endif
+#ifndef USI_UART_TX_BUFFER_SIZE
 #define USI_UART_TX_BUFFER_SIZE 16
+#endif
+
+/* If set to 1, the receiver counts bytes, framing errors (low stop
+ * bit) and overruns (input buffer full), see usi_uart_get_stats().
+ * Bytes with a framing error are always discarded.
+ */
+#ifndef USI_UART_STATS
+#define USI_UART_STATS 0
+#endif
+
+/* If set to 1, usi_uart_calibrate() tunes the internal oscillator
+ * (OSCCAL) until the bit time of received sync bytes (0x55) matches
+ * BAUDRATE at F_CPU.
+ *
+ * With CALIBRATION_EEPROM set to 1 the result is stored in the eeprom
+ * at CALIBRATION_EEPROM_ADDR, usi_uart_calibration_load() restores it
+ * at start-up.
+ */
+#ifndef CALIBRATION
+#define CALIBRATION 0
+#endif
+#ifndef CALIBRATION_EEPROM
+#define CALIBRATION_EEPROM 0
+#endif
+#ifndef CALIBRATION_EEPROM_ADDR
+#define CALIBRATION_EEPROM_ADDR ((uint8_t *)0)
+#endif
+
+/* milliseconds to wait for the sync bytes of one measurement */
+#ifndef CALIBRATION_TIMEOUT
+#define CALIBRATION_TIMEOUT 500
+#endif
+
+#if USI_UART_STATS
+typedef struct {
+	uint16_t rx_bytes;      /* bytes stored in the input buffer */
+	uint16_t frame_errors;  /* stop bit was low, byte discarded */
+	uint16_t overruns;      /* input buffer was full, byte discarded */
+	uint8_t rx_high_water;  /* max number of bytes in the input buffer */
+} usi_uart_stats_t;
+#endif
 
 
 /*
@@ -66,6 +200,27 @@ uint8_t usi_uart_sendc(char c);
  */
 uint8_t usi_uart_sends(const char *s);
 
+/*
+ * Same as usi_uart_sends(), but the string is read directly from
+ * flash (PROGMEM) without a copy in ram.
+ *
+ * Returns the number bytes transmitted.
+ */
+uint8_t usi_uart_sends_P(const char *s);
+
+/*
+ * Send 'n' bytes from 'buf' in flash (PROGMEM).
+ *
+ * Returns the number bytes transmitted.
+ */
+uint8_t usi_uart_sendn_P(const uint8_t *buf, uint8_t n);
+
+/*
+ * Send a string literal that is kept in flash only,
+ * eg usi_uart_sends_PSTR("hello\n").
+ */
+#define usi_uart_sends_PSTR(s) usi_uart_sends_P(PSTR(s))
+
 /*
  * Returns the number of bytes available in the input buffer.
  */
@@ -93,9 +248,77 @@ uint8_t usi_uart_recvn(char *buf, uint8_t n);
  */
 uint8_t usi_uart_recv_until(char *buf, uint8_t size, char delimiter);
 
+/*
+ * Same as usi_uart_recvc(), but waits for incoming data at most
+ * 'timeout_ms' milliseconds (0 waits forever).
+ *
+ * Returns zero on success, one on timeout.
+ */
+uint8_t usi_uart_recvc_timeout(char *c, uint16_t timeout_ms);
+
+/*
+ * Same as usi_uart_recv_until(), but waits for incoming data at most
+ * 'timeout_ms' milliseconds per byte (0 waits forever).
+ *
+ * Returns the number of bytes written to 'buf' (including 'delimiter').
+ */
+uint8_t usi_uart_recv_until_timeout(char *buf, uint8_t size, char delimiter,
+		uint16_t timeout_ms);
+
+#if RX_CALLBACK
+/*
+ * Set the function that is called from the receive interrupt with
+ * the received byte, see RX_CALLBACK. NULL disables it.
+ */
+void usi_uart_set_rx_callback(void (*callback)(char c));
+#endif
+
+/*
+ * Wait until all data in the output buffer was sent, including the
+ * stop bit of the last byte.
+ */
+void usi_uart_flush();
+
 /*
  * Discard everything currently in the reveive buffer.
  */
 void usi_uart_rx_buffer_clear();
 
+#if CALIBRATION
+/*
+ * Measure the bit time of sync bytes (0x55) sent by the other side and
+ * adjust OSCCAL until it matches. Waits until the uart is idle and
+ * blocks while calibrating, interrupts must be enabled. Data received
+ * meanwhile is discarded, bytes queued by interrupts are sent afterwards.
+ *
+ * Returns zero on success, one on error (no sync bytes received within
+ * CALIBRATION_TIMEOUT or the remaining error is more than 2%; OSCCAL
+ * is set to the best value found anyway).
+ */
+uint8_t usi_uart_calibrate();
+
+#if CALIBRATION_EEPROM
+/*
+ * Set OSCCAL to the value stored by usi_uart_calibrate().
+ *
+ * Returns zero on success, one if no value was stored.
+ */
+uint8_t usi_uart_calibration_load();
+#endif
+#endif
+
+#if USI_UART_STATS
+/*
+ * Copy the receive statistics to 'dest'. The high-water mark shows
+ * how full the input buffer got and helps choosing
+ * USI_UART_RX_BUFFER_SIZE.
+ */
+void usi_uart_get_stats(usi_uart_stats_t *dest);
+
+/*
+ * Set all counters and the high-water mark to zero.
+ */
+void usi_uart_reset_stats();
+#endif
+
 #endif
@@ -1,4 +1,3 @@
-#include <stdlib.h>
 #include <avr/io.h>
 #include <avr/interrupt.h>
 #include <util/delay.h>
@@ -14,7 +13,6 @@ int main()
 {
 	uint8_t device_count, crc;
 	uint8_t device_id[BUFSIZE][8];
-	char text_buf[6];
 
 	uart_init();
 	sei();
@@ -22,22 +20,19 @@ int main()
 	while (1) {
 
 		device_count = w1_find_devices(device_id, BUFSIZE);
-		itoa(device_count, text_buf, 10);
 
-		uart_puts("Found "); uart_puts(text_buf); uart_puts(" device(s)\n");
+		uart_printf_P(PSTR("Found %u device(s)\n"), device_count);
 
 		for (uint8_t i=0; i<device_count; i++) {
 			crc = 0;
-			uart_puts(itoa(i+1, text_buf, 10));
-			uart_puts(".  ");
+			uart_printf_P(PSTR("%u.  "), i+1);
 			for (uint8_t j=0; j<8; j++)	{
 				crc = _crc_ibutton_update(crc, device_id[i][j]);
-				uart_puts(itoa(device_id[i][j], text_buf, 16));
-				uart_puts(" ");
+				uart_printf_P(PSTR("%x "), device_id[i][j]);
 			}
-			uart_puts(" (crc ");
-			if (crc == 0) uart_puts("ok)\n");
-			else uart_puts("failed)\n");
+			uart_puts_PSTR(" (crc ");
+			if (crc == 0) uart_puts_PSTR("ok)\n");
+			else uart_puts_PSTR("failed)\n");
 
 		}
 